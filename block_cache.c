@@ -0,0 +1,619 @@
+/**
+ * Block cache
+ * A fixed number of block sized slots, looked up by block number through a
+ * chained hash table. Slots are reused with the CLOCK algorithm: every hit
+ * sets the slot's reference bit, and the clock hand clears reference bits
+ * until it finds a slot that was not used since its last pass.
+ * Transfers of at least a quarter of the cache bypass it and go straight
+ * between the caller's buffer and the disk, so a single large read or write
+ * does not flush every hot block out of the cache.
+ * Blocks can also be read ahead of time with cache_prefetch_blocks, such
+ * blocks are flagged until their first read to count read-ahead hits.
+ * Read-ahead and write-back go through the disk's asynchronous queue: a
+ * prefetch only enters the cache once it completes, and a flush submits all
+ * of its runs before waiting for any of them.
+ * Every entry point holds the cache lock, except while a read waits for the
+ * disk, so that threads missing on different blocks wait for it together.
+ * That includes waiting for blocks still being read ahead: one thread at a
+ * time reaps the disk's queue with the lock let go, and hands what it got to
+ * the others.
+ * A memory mapped disk already keeps every block in RAM, so in that mode the
+ * cache holds nothing and passes all transfers through to the mapping.
+ */
+
+#include "block_cache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk_emu.h"
+
+typedef struct cache_slot {
+  int block_num;  // -1 when the slot is empty
+  bool dirty;
+  bool referenced;
+  bool prefetched;  // read ahead and not read since
+  int next;  // next slot in the same hash chain
+} CacheSlot;
+
+int cache_capacity = 0;
+int cache_block_size = 0;
+CacheSlot *slots = NULL;
+char *slot_data = NULL;
+int *hash_heads = NULL;
+int hash_size = 0;  // always a power of two
+int clock_hand = 0;
+CacheStats cache_stats = {0};
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_PREFETCHES 8
+#define REAP_BATCH 16
+
+// a read-ahead that was submitted and not yet copied into the cache
+typedef struct prefetch {
+  DiskAio request;
+  bool stale;  // some of its blocks were written since it was submitted
+} Prefetch;
+
+Prefetch *prefetches[MAX_PREFETCHES];
+int no_prefetches = 0;
+int writes_in_flight = 0;
+// a thread waits for the disk's queue without the cache lock, and nobody
+// else waits for it until reaped_cond says it is done
+bool reaping = false;
+pthread_cond_t reaped_cond = PTHREAD_COND_INITIALIZER;
+
+void wait_prefetches();
+
+// transfers of this many blocks or more bypass the cache
+int bypass_threshold() {
+  return cache_capacity / 4 > 1 ? cache_capacity / 4 : 2;
+}
+
+int hash_block(int block_num) { return block_num & (hash_size - 1); }
+
+char *slot_buffer(int slot) {
+  return slot_data + (size_t)slot * cache_block_size;
+}
+
+int cache_lookup(int block_num) {
+  int slot = hash_heads[hash_block(block_num)];
+  while (slot != -1 && slots[slot].block_num != block_num) {
+    slot = slots[slot].next;
+  }
+  return slot;
+}
+
+void hash_insert(int slot) {
+  int head = hash_block(slots[slot].block_num);
+  slots[slot].next = hash_heads[head];
+  hash_heads[head] = slot;
+}
+
+void hash_remove(int slot) {
+  int *link = &hash_heads[hash_block(slots[slot].block_num)];
+  while (*link != slot) {
+    link = &slots[*link].next;
+  }
+  *link = slots[slot].next;
+}
+
+int init_slots(int capacity, int block_size) {
+  cache_capacity = capacity;
+  cache_block_size = block_size;
+  hash_size = 1;
+  while (hash_size < 2 * capacity) {
+    hash_size *= 2;
+  }
+
+  slots = (CacheSlot *)malloc(capacity * sizeof(CacheSlot));
+  slot_data = (char *)malloc((size_t)capacity * block_size);
+  hash_heads = (int *)malloc(hash_size * sizeof(int));
+  if (slots == NULL || slot_data == NULL || hash_heads == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < capacity; i++) {
+    slots[i].block_num = -1;
+    slots[i].dirty = false;
+    slots[i].referenced = false;
+    slots[i].prefetched = false;
+    slots[i].next = -1;
+  }
+  for (int i = 0; i < hash_size; i++) {
+    hash_heads[i] = -1;
+  }
+  clock_hand = 0;
+  return 0;
+}
+
+void free_slots() {
+  free(slots);
+  free(slot_data);
+  free(hash_heads);
+  slots = NULL;
+  slot_data = NULL;
+  hash_heads = NULL;
+  cache_capacity = 0;
+}
+
+int cache_init(int capacity, int block_size) {
+  pthread_mutex_lock(&cache_lock);
+  int status = init_slots(capacity, block_size);
+  if (status < 0) {
+    free_slots();
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return status;
+}
+
+void cache_destroy() {
+  pthread_mutex_lock(&cache_lock);
+  wait_prefetches();
+  free_slots();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// write a dirty slot back together with the dirty cached blocks on either
+// side of it, gathered into one buffer so the run goes out as a single disk
+// write. The neighbours stay cached, they are only clean afterwards. Returns
+// -1 if the write failed.
+int write_back_run(int slot) {
+  int first = slots[slot].block_num;
+  int last = first;
+  int neighbour;
+  while ((neighbour = cache_lookup(first - 1)) != -1 &&
+         slots[neighbour].dirty) {
+    first--;
+  }
+  while ((neighbour = cache_lookup(last + 1)) != -1 &&
+         slots[neighbour].dirty) {
+    last++;
+  }
+
+  char *gathered = NULL;
+  if (last > first) {
+    gathered = (char *)malloc((size_t)(last - first + 1) * cache_block_size);
+  }
+  if (gathered == NULL) {
+    int written = write_blocks(slots[slot].block_num, 1, slot_buffer(slot));
+    slots[slot].dirty = false;
+    cache_stats.writebacks++;
+    return written < 0 ? -1 : 0;
+  }
+
+  for (int block_num = first; block_num <= last; block_num++) {
+    int run_slot = cache_lookup(block_num);
+    memcpy(gathered + (size_t)(block_num - first) * cache_block_size,
+           slot_buffer(run_slot), cache_block_size);
+    slots[run_slot].dirty = false;
+  }
+  int written = write_blocks(first, last - first + 1, gathered);
+  cache_stats.writebacks += last - first + 1;
+  free(gathered);
+  return written < 0 ? -1 : 0;
+}
+
+// advance the clock hand until a slot without its reference bit is found,
+// writing the victim back first if it is dirty
+int evict_slot() {
+  while (true) {
+    int slot = clock_hand;
+    clock_hand = (clock_hand + 1) % cache_capacity;
+
+    if (slots[slot].block_num == -1) {
+      return slot;
+    }
+    if (slots[slot].referenced) {
+      slots[slot].referenced = false;
+      continue;
+    }
+
+    if (slots[slot].dirty) {
+      write_back_run(slot);
+    }
+    hash_remove(slot);
+    slots[slot].block_num = -1;
+    slots[slot].dirty = false;
+    slots[slot].prefetched = false;
+    cache_stats.evictions++;
+    return slot;
+  }
+}
+
+// get a slot for block_num, its contents are undefined if it was not cached
+int cache_slot_for(int block_num) {
+  int slot = cache_lookup(block_num);
+  if (slot != -1) {
+    return slot;
+  }
+  slot = evict_slot();
+  slots[slot].block_num = block_num;
+  hash_insert(slot);
+  return slot;
+}
+
+// copy a completed read-ahead into the cache, skipping the blocks that were
+// cached in the meantime since those copies are at least as recent
+void finish_prefetch(Prefetch *prefetch) {
+  DiskAio *request = &prefetch->request;
+  for (int i = 0; i < no_prefetches; i++) {
+    if (prefetches[i] == prefetch) {
+      prefetches[i] = prefetches[--no_prefetches];
+      break;
+    }
+  }
+  if (request->result >= 0 && !prefetch->stale && slots != NULL) {
+    for (int i = 0; i < request->nblocks; i++) {
+      if (cache_lookup(request->start_address + i) != -1) {
+        continue;
+      }
+      int slot = cache_slot_for(request->start_address + i);
+      memcpy(slot_buffer(slot), (char *)request->buffer + i * cache_block_size,
+             cache_block_size);
+      slots[slot].dirty = false;
+      slots[slot].prefetched = true;
+      cache_stats.prefetched++;
+    }
+  }
+  free(request->buffer);
+  free(prefetch);
+}
+
+void finish_requests(DiskAio **done, int n) {
+  for (int i = 0; i < n; i++) {
+    if (done[i]->op == DISK_AIO_READ) {
+      finish_prefetch((Prefetch *)done[i]->data);
+    } else {
+      writes_in_flight--;
+    }
+  }
+}
+
+// wait for a thread reaping without the cache lock to hand back what it got.
+// Nothing else waits for the disk's queue meanwhile, since that thread could
+// not take the lock again to count the requests it reaped. Once this
+// returns, no thread reaps until the lock is let go.
+void wait_reaper() {
+  while (reaping) {
+    pthread_cond_wait(&reaped_cond, &cache_lock);
+  }
+}
+
+// handle finished disk requests after waiting for at least min of them
+void reap_requests(int min) {
+  DiskAio *done[REAP_BATCH];
+  int n;
+  if (min > 0) {
+    wait_reaper();
+  }
+  do {
+    n = disk_aio_reap(done, REAP_BATCH, min);
+    finish_requests(done, n);
+    min -= n;
+  } while (n > 0 && min > 0);
+}
+
+// wait for at least one disk request to finish with the cache lock let go,
+// or for another thread doing so to hand back what it got
+void reap_unlocked() {
+  if (reaping) {
+    wait_reaper();
+    return;
+  }
+  DiskAio *done[REAP_BATCH];
+  reaping = true;
+  pthread_mutex_unlock(&cache_lock);
+  int n = disk_aio_reap(done, REAP_BATCH, 1);
+  pthread_mutex_lock(&cache_lock);
+  reaping = false;
+  finish_requests(done, n);
+  pthread_cond_broadcast(&reaped_cond);
+}
+
+// wait for every read-ahead in flight. Nothing reaps without the cache lock
+// afterwards, so a flush keeps it until its writes are done.
+void wait_prefetches() {
+  wait_reaper();
+  while (no_prefetches > 0) {
+    reap_requests(1);
+  }
+}
+
+bool overlaps_prefetch(int start_address, int nblocks) {
+  for (int i = 0; i < no_prefetches; i++) {
+    DiskAio *request = &prefetches[i]->request;
+    if (request->start_address < start_address + nblocks &&
+        start_address < request->start_address + request->nblocks) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int cache_read_blocks(int start_address, int nblocks, void *buffer) {
+  if (get_block_ptr(start_address) != NULL) {
+    return read_blocks(start_address, nblocks, buffer);
+  }
+  pthread_mutex_lock(&cache_lock);
+
+  // blocks still being read ahead are waited for rather than read twice,
+  // without holding up threads after other blocks
+  if (no_prefetches > 0) {
+    reap_requests(0);
+    while (overlaps_prefetch(start_address, nblocks)) {
+      reap_unlocked();
+    }
+  }
+
+  char *out = (char *)buffer;
+  int i = 0;
+  while (i < nblocks) {
+    int slot = cache_lookup(start_address + i);
+    if (slot != -1) {
+      memcpy(out + i * cache_block_size, slot_buffer(slot), cache_block_size);
+      slots[slot].referenced = true;
+      cache_stats.hits++;
+      if (slots[slot].prefetched) {
+        slots[slot].prefetched = false;
+        cache_stats.prefetch_hits++;
+      }
+      i++;
+      continue;
+    }
+
+    // read the whole run of missing blocks with a single disk access, straight
+    // into the caller's buffer, then copy it into the cache. The lock is let
+    // go meanwhile, and blocks cached by then are taken from the cache since
+    // that copy is at least as recent.
+    int run_start = i;
+    while (i < nblocks && cache_lookup(start_address + i) == -1) {
+      i++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    int status = read_blocks(start_address + run_start, i - run_start,
+                             out + run_start * cache_block_size);
+    pthread_mutex_lock(&cache_lock);
+    if (status < 0) {
+      pthread_mutex_unlock(&cache_lock);
+      return -1;
+    }
+    bool bypass = i - run_start >= bypass_threshold();
+    for (int j = run_start; j < i; j++) {
+      slot = cache_lookup(start_address + j);
+      if (slot != -1) {
+        memcpy(out + j * cache_block_size, slot_buffer(slot),
+               cache_block_size);
+      } else if (bypass) {
+        cache_stats.bypassed++;
+      } else {
+        slot = cache_slot_for(start_address + j);
+        memcpy(slot_buffer(slot), out + j * cache_block_size,
+               cache_block_size);
+        slots[slot].dirty = false;
+        cache_stats.misses++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return nblocks;
+}
+
+int cache_write_blocks(int start_address, int nblocks, void *buffer) {
+  if (get_block_ptr(start_address) != NULL) {
+    return write_blocks(start_address, nblocks, buffer);
+  }
+  pthread_mutex_lock(&cache_lock);
+
+  char *in = (char *)buffer;
+  for (int i = 0; i < no_prefetches; i++) {
+    DiskAio *request = &prefetches[i]->request;
+    if (request->start_address < start_address + nblocks &&
+        start_address < request->start_address + request->nblocks) {
+      prefetches[i]->stale = true;
+    }
+  }
+
+  // large writes go straight to the disk, cached copies of the blocks are
+  // refreshed so they stay consistent with it
+  if (nblocks >= bypass_threshold()) {
+    if (write_blocks(start_address, nblocks, buffer) < 0) {
+      pthread_mutex_unlock(&cache_lock);
+      return -1;
+    }
+    for (int i = 0; i < nblocks; i++) {
+      int slot = cache_lookup(start_address + i);
+      if (slot != -1) {
+        memcpy(slot_buffer(slot), in + i * cache_block_size, cache_block_size);
+        slots[slot].dirty = false;
+        slots[slot].prefetched = false;
+      }
+    }
+    cache_stats.bypassed += nblocks;
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+  }
+
+  for (int i = 0; i < nblocks; i++) {
+    int slot = cache_slot_for(start_address + i);
+    memcpy(slot_buffer(slot), in + i * cache_block_size, cache_block_size);
+    slots[slot].dirty = true;
+    slots[slot].referenced = true;
+    slots[slot].prefetched = false;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return nblocks;
+}
+
+// start reading blocks that are expected to be read soon, at most half of the
+// cache. Blocks already cached or being read ahead are left alone, and each
+// run of missing ones is read with a single asynchronous disk access. Runs
+// that find the queue full are skipped, read-ahead is only a hint.
+int prefetch_blocks(int start_address, int nblocks) {
+  if (slots == NULL) {
+    return 0;
+  }
+  if (nblocks > cache_capacity / 2) {
+    nblocks = cache_capacity / 2;
+  }
+
+  reap_requests(0);
+  int i = 0;
+  while (i < nblocks && no_prefetches < MAX_PREFETCHES) {
+    if (cache_lookup(start_address + i) != -1 ||
+        overlaps_prefetch(start_address + i, 1)) {
+      i++;
+      continue;
+    }
+    int run_start = i;
+    while (i < nblocks && cache_lookup(start_address + i) == -1 &&
+           !overlaps_prefetch(start_address + i, 1)) {
+      i++;
+    }
+
+    Prefetch *prefetch = (Prefetch *)malloc(sizeof(Prefetch));
+    char *buffer = (char *)malloc((size_t)(i - run_start) * cache_block_size);
+    if (prefetch == NULL || buffer == NULL) {
+      free(prefetch);
+      free(buffer);
+      return -1;
+    }
+    prefetch->request.op = DISK_AIO_READ;
+    prefetch->request.start_address = start_address + run_start;
+    prefetch->request.nblocks = i - run_start;
+    prefetch->request.buffer = buffer;
+    prefetch->request.data = prefetch;
+    prefetch->stale = false;
+    if (disk_aio_submit(&prefetch->request) < 0) {
+      free(buffer);
+      free(prefetch);
+      return -1;
+    }
+    prefetches[no_prefetches++] = prefetch;
+  }
+  return nblocks;
+}
+
+int cache_prefetch_blocks(int start_address, int nblocks) {
+  if (get_block_ptr(start_address) != NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&cache_lock);
+  int status = prefetch_blocks(start_address, nblocks);
+  pthread_mutex_unlock(&cache_lock);
+  return status;
+}
+
+int compare_slot_blocks(const void *a, const void *b) {
+  return slots[*(const int *)a].block_num - slots[*(const int *)b].block_num;
+}
+
+// write every dirty block back with one synchronous write per run, for when
+// flush_slots cannot get the memory to sort and gather them
+int write_back_dirty() {
+  int status = 0;
+  for (int i = 0; i < cache_capacity; i++) {
+    if (slots[i].block_num != -1 && slots[i].dirty && write_back_run(i) < 0) {
+      status = -1;
+    }
+  }
+  return status;
+}
+
+// write every dirty block back to the disk in block order. Each run of
+// consecutive dirty blocks is gathered into one buffer and goes out as a
+// single asynchronous write, and all the runs are submitted before waiting
+// for them so the disk can work on them together.
+int flush_slots() {
+  if (slots == NULL) {
+    return -1;
+  }
+  wait_prefetches();
+
+  int *dirty = (int *)malloc(cache_capacity * sizeof(int));
+  if (dirty == NULL) {
+    return write_back_dirty();
+  }
+  int no_dirty = 0;
+  for (int i = 0; i < cache_capacity; i++) {
+    if (slots[i].block_num != -1 && slots[i].dirty) {
+      dirty[no_dirty++] = i;
+    }
+  }
+  if (no_dirty == 0) {
+    free(dirty);
+    return 0;
+  }
+  qsort(dirty, no_dirty, sizeof(int), compare_slot_blocks);
+
+  DiskAio *writes = (DiskAio *)malloc(no_dirty * sizeof(DiskAio));
+  char *gathered = (char *)malloc((size_t)no_dirty * cache_block_size);
+  if (writes == NULL || gathered == NULL) {
+    free(gathered);
+    free(writes);
+    free(dirty);
+    return write_back_dirty();
+  }
+  int status = 0;
+  int no_writes = 0;
+  int i = 0;
+  while (i < no_dirty) {
+    int run_start = i;
+    do {
+      memcpy(gathered + (size_t)i * cache_block_size, slot_buffer(dirty[i]),
+             cache_block_size);
+      slots[dirty[i]].dirty = false;
+      i++;
+    } while (i < no_dirty && slots[dirty[i]].block_num ==
+                                 slots[dirty[i - 1]].block_num + 1);
+
+    DiskAio *request = &writes[no_writes++];
+    request->op = DISK_AIO_WRITE;
+    request->start_address = slots[dirty[run_start]].block_num;
+    request->nblocks = i - run_start;
+    request->buffer = gathered + (size_t)run_start * cache_block_size;
+    request->data = NULL;
+    if (disk_aio_submit(request) < 0) {
+      status = -1;
+      no_writes--;
+    } else {
+      writes_in_flight++;
+    }
+    cache_stats.writebacks += i - run_start;
+  }
+  while (writes_in_flight > 0) {
+    reap_requests(writes_in_flight);
+  }
+  for (i = 0; i < no_writes; i++) {
+    if (writes[i].result < 0) {
+      status = -1;
+    }
+  }
+
+  free(gathered);
+  free(writes);
+  free(dirty);
+  return status;
+}
+
+int cache_flush() {
+  pthread_mutex_lock(&cache_lock);
+  int status = flush_slots();
+  pthread_mutex_unlock(&cache_lock);
+  return status;
+}
+
+void cache_get_stats(CacheStats *stats) {
+  pthread_mutex_lock(&cache_lock);
+  *stats = cache_stats;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_reset_stats() {
+  pthread_mutex_lock(&cache_lock);
+  memset(&cache_stats, 0, sizeof(cache_stats));
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,36 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+// In-memory write-back block cache sitting between sfs.c and disk_emu.c.
+// Blocks are evicted with the CLOCK algorithm, dirty blocks only reach the
+// disk when they are evicted or when cache_flush is called.
+
+#define DEFAULT_CACHE_BLOCKS 256
+
+typedef struct cache_stats {
+  long hits;           // blocks served from the cache
+  long misses;         // blocks that had to be read from the disk
+  long evictions;      // blocks dropped to make room for another one
+  long writebacks;     // dirty blocks written to the disk
+  long bypassed;       // blocks of large transfers that skipped the cache
+  long prefetched;     // blocks read ahead by cache_prefetch_blocks
+  long prefetch_hits;  // read ahead blocks that were then read
+} CacheStats;
+
+int cache_init(int capacity, int block_size);
+
+void cache_destroy();
+
+int cache_read_blocks(int start_address, int nblocks, void *buffer);
+
+int cache_write_blocks(int start_address, int nblocks, void *buffer);
+
+int cache_prefetch_blocks(int start_address, int nblocks);
+
+int cache_flush();
+
+void cache_get_stats(CacheStats *stats);
+
+void cache_reset_stats();
+
+#endif
@@ -2,23 +2,1002 @@
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+/*linux/fs.h, pulled in above, has its own BLOCK_SIZE*/
+#undef BLOCK_SIZE
+#endif
 #include "disk_emu.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int fd = -1;
+int backend = -1;
+int preallocate = -1;
+char* map = NULL;
+int BLOCK_SIZE, MAX_BLOCK;
+
+/*The stdio backend seeks before every transfer, so its transfers take */
+/*turns on the stream. The other backends pass offsets with each call.*/
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef SFS_NO_STATS
+/*Transfers that reached the backend, updated with atomic adds*/
+static DiskStats stats;
+#endif
+
+/*---------------------------------------------------------------*/
+/*Selects the backend used by the next init_disk/init_fresh_disk. */
+/*Without a call, DISK_EMU_BACKEND=pread or mmap in the environment*/
+/*picks that backend, and stdio is used otherwise.                */
+/*---------------------------------------------------------------*/
+int disk_set_backend(int new_backend)
+{
+    if (new_backend != DISK_BACKEND_STDIO && new_backend != DISK_BACKEND_PREAD
+        && new_backend != DISK_BACKEND_MMAP)
+    {
+        return -1;
+    }
+    backend = new_backend;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*The device model. A transfer waits for the least busy of the       */
+/*queue_depth channels (1 unless SSD), is served in the time the     */
+/*model gives it, then moves its data over a bus shared by all the   */
+/*channels at the bandwidth of the model. Channels and bus are free  */
+/*from a point of the monotonic clock. When simulate skips pausing,  */
+/*each thread keeps the time it would have paused for in its own     */
+/*clock offset, so that it makes its next transfers when it would    */
+/*have made them on the real device. Asynchronous requests carry the */
+/*clock of the thread submitting them to the one serving them, and   */
+/*the time they are done at back to the one reaping them.            */
+/*------------------------------------------------------------------*/
+#define MAX_QUEUE_DEPTH 256
+
+static DiskModel model;
+static int model_on = 0;  /*read without model_lock, 0 for DISK_MODEL_NONE*/
+static int model_simulate = 0;  /*read without model_lock*/
+static int model_chosen = 0;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+static long channel_free[MAX_QUEUE_DEPTH];
+static long bus_free = 0;
+static int head_block = 0;  /*HDD: block right after the last transfer*/
+static __thread long simulated_ns = 0;
+
+static long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*The calling thread's clock, 0 when transfers take no time*/
+static long simulated_now()
+{
+    if (!__atomic_load_n(&model_on, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    return now_ns() + simulated_ns;
+}
+
+/*---------------------------------------------------------------*/
+/*Selects how long transfers take from now on, and resets the    */
+/*device's queues. Without a call, DISK_EMU_MODEL=fixed, hdd or   */
+/*ssd in the environment picks that preset at the next            */
+/*init_disk/init_fresh_disk (DISK_EMU_SIMULATE=1 then accounts the*/
+/*time without pausing), and transfers take no time otherwise.    */
+/*---------------------------------------------------------------*/
+int disk_set_model(const DiskModel *new_model)
+{
+    if (new_model->type < DISK_MODEL_NONE || new_model->type > DISK_MODEL_SSD
+        || new_model->read_us < 0 || new_model->write_us < 0
+        || new_model->seek_us < 0 || new_model->rotation_us < 0
+        || new_model->bandwidth < 0
+        || (new_model->type == DISK_MODEL_SSD
+            && (new_model->queue_depth < 1
+                || new_model->queue_depth > MAX_QUEUE_DEPTH)))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&model_lock);
+    model = *new_model;
+    __atomic_store_n(&model_on, model.type != DISK_MODEL_NONE,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&model_simulate, model.simulate, __ATOMIC_RELAXED);
+    memset(channel_free, 0, sizeof(channel_free));
+    bus_free = 0;
+    head_block = 0;
+    model_chosen = 1;
+    pthread_mutex_unlock(&model_lock);
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Fills preset with the model named fixed (100us per block), hdd  */
+/*(7200rpm, 15ms full seek, 150MB/s) or ssd (80us reads, 20us     */
+/*writes, 32 at once, 2000MB/s), -1 for other names               */
+/*---------------------------------------------------------------*/
+int disk_model_by_name(const char *name, DiskModel *preset)
+{
+    memset(preset, 0, sizeof(*preset));
+    if (strcmp(name, "fixed") == 0)
+    {
+        preset->type = DISK_MODEL_FIXED;
+        preset->read_us = 100;
+        preset->write_us = 100;
+    }
+    else if (strcmp(name, "hdd") == 0)
+    {
+        preset->type = DISK_MODEL_HDD;
+        preset->read_us = 100;
+        preset->write_us = 100;
+        preset->seek_us = 15000;
+        preset->rotation_us = 8333;
+        preset->bandwidth = 150;
+    }
+    else if (strcmp(name, "ssd") == 0)
+    {
+        preset->type = DISK_MODEL_SSD;
+        preset->read_us = 80;
+        preset->write_us = 20;
+        preset->queue_depth = 32;
+        preset->bandwidth = 2000;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Sets the emulated latency of every block written, in            */
+/*microseconds, as a fixed model with free reads. It is 0 by      */
+/*default, and no pause is made at all then, so that benchmarks   */
+/*time the file system rather than the emulated device.           */
+/*---------------------------------------------------------------*/
+int disk_set_latency(double microseconds)
+{
+    DiskModel fixed;
+
+    memset(&fixed, 0, sizeof(fixed));
+    fixed.type = (microseconds > 0) ? DISK_MODEL_FIXED : DISK_MODEL_NONE;
+    fixed.write_us = microseconds;
+    return disk_set_model(&fixed);
+}
+
+static void choose_model()
+{
+    char *env = getenv("DISK_EMU_MODEL");
+    char *simulate = getenv("DISK_EMU_SIMULATE");
+    DiskModel preset;
+
+    if (model_chosen || NULL == env || disk_model_by_name(env, &preset) < 0)
+    {
+        return;
+    }
+    preset.simulate = (NULL != simulate && strcmp(simulate, "1") == 0);
+    disk_set_model(&preset);
+}
+
+/*Serves a transfer on the modelled device, returns the point of the */
+/*calling thread's clock it is done at, or 0 without a model         */
+static long model_transfer(int op, int start_address, int nblocks)
+{
+    long now, start, done, access_ns, data_ns;
+    double us;
+    int i, channel, channels, distance;
+
+    if (!__atomic_load_n(&model_on, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    now = now_ns() + simulated_ns;
+    pthread_mutex_lock(&model_lock);
+    if (DISK_MODEL_NONE == model.type)
+    {
+        pthread_mutex_unlock(&model_lock);
+        return 0;
+    }
+    us = (op == DISK_AIO_WRITE) ? model.write_us : model.read_us;
+    if (DISK_MODEL_FIXED == model.type)
+    {
+        us *= nblocks;
+    }
+    else if (DISK_MODEL_HDD == model.type)
+    {
+        /*The seek grows linearly with the distance the head travels*/
+        if (start_address != head_block)
+        {
+            distance = abs(start_address - head_block);
+            us += model.seek_us * distance / MAX_BLOCK
+                  + model.rotation_us / 2;
+        }
+        head_block = start_address + nblocks;
+    }
+    access_ns = (long)(us * 1000);
+    data_ns = (model.bandwidth > 0)
+        ? (long)((double)nblocks * BLOCK_SIZE * 1000
+                 / (model.bandwidth * 1.048576))
+        : 0;
+
+    channels = (DISK_MODEL_SSD == model.type) ? model.queue_depth : 1;
+    channel = 0;
+    for (i = 1; i < channels; i++)
+    {
+        if (channel_free[i] < channel_free[channel])
+        {
+            channel = i;
+        }
+    }
+    start = (channel_free[channel] > now) ? channel_free[channel] : now;
+    done = start + access_ns;
+    if (data_ns > 0)
+    {
+        done = ((bus_free > done) ? bus_free : done) + data_ns;
+        bus_free = done;
+    }
+    channel_free[channel] = done;
+#ifndef SFS_NO_STATS
+    __atomic_add_fetch(&stats.device_ns, access_ns + data_ns,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.wait_ns, done - now, __ATOMIC_RELAXED);
+#endif
+    pthread_mutex_unlock(&model_lock);
+    return done;
+}
+
+/*Pauses until the device is done with a transfer, or moves the      */
+/*calling thread's clock on to that point when simulating             */
+static void model_wait(long done)
+{
+    struct timespec ts;
+    long left = (done > 0) ? done - now_ns() : 0;
+
+    if (__atomic_load_n(&model_simulate, __ATOMIC_RELAXED))
+    {
+        if (left > simulated_ns)
+        {
+            simulated_ns = left;
+        }
+    }
+    else if (left > 0)
+    {
+        ts.tv_sec = left / 1000000000L;
+        ts.tv_nsec = left % 1000000000L;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        {
+        }
+    }
+}
+
+/*Counts a transfer of nblocks reaching the backend*/
+static void count_transfer(int op, int nblocks)
+{
+#ifndef SFS_NO_STATS
+    long *transfers = (op == DISK_AIO_WRITE) ? &stats.writes : &stats.reads;
+    long *blocks = (op == DISK_AIO_WRITE) ? &stats.blocks_written
+                                          : &stats.blocks_read;
+    long *bytes = (op == DISK_AIO_WRITE) ? &stats.bytes_written
+                                         : &stats.bytes_read;
+
+    __atomic_add_fetch(transfers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(blocks, nblocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(bytes, (long)nblocks * BLOCK_SIZE, __ATOMIC_RELAXED);
+#endif
+}
+
+/*Counts a transfer and pauses for as long as the device takes to serve it*/
+static void device_transfer(int op, int start_address, int nblocks)
+{
+    count_transfer(op, nblocks);
+    model_wait(model_transfer(op, start_address, nblocks));
+}
+
+/*---------------------------------------------------------------*/
+/*Copies the transfer counters, all 0 when built with SFS_NO_STATS*/
+/*---------------------------------------------------------------*/
+void disk_get_stats(DiskStats *copy)
+{
+#ifndef SFS_NO_STATS
+    copy->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    copy->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    copy->blocks_read = __atomic_load_n(&stats.blocks_read, __ATOMIC_RELAXED);
+    copy->blocks_written =
+        __atomic_load_n(&stats.blocks_written, __ATOMIC_RELAXED);
+    copy->bytes_read = __atomic_load_n(&stats.bytes_read, __ATOMIC_RELAXED);
+    copy->bytes_written =
+        __atomic_load_n(&stats.bytes_written, __ATOMIC_RELAXED);
+    copy->device_ns = __atomic_load_n(&stats.device_ns, __ATOMIC_RELAXED);
+    copy->wait_ns = __atomic_load_n(&stats.wait_ns, __ATOMIC_RELAXED);
+#else
+    memset(copy, 0, sizeof(*copy));
+#endif
+}
+
+void disk_reset_stats()
+{
+#ifndef SFS_NO_STATS
+    __atomic_store_n(&stats.reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.blocks_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.blocks_written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.bytes_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.bytes_written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.device_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.wait_ns, 0, __ATOMIC_RELAXED);
+#endif
+}
+
+/*---------------------------------------------------------------*/
+/*Selects whether the next init_fresh_disk reserves the space of  */
+/*the whole image (1) or leaves it sparse (0). Without a call,    */
+/*DISK_EMU_PREALLOCATE=1 in the environment preallocates.         */
+/*---------------------------------------------------------------*/
+int disk_set_preallocate(int new_preallocate)
+{
+    if (new_preallocate != 0 && new_preallocate != 1)
+    {
+        return -1;
+    }
+    preallocate = new_preallocate;
+    return 0;
+}
+
+static int choose_backend()
+{
+    char *env = getenv("DISK_EMU_BACKEND");
+
+    if (backend == -1)
+    {
+        backend = DISK_BACKEND_STDIO;
+        if (env != NULL && strcmp(env, "pread") == 0)
+        {
+            backend = DISK_BACKEND_PREAD;
+        }
+        else if (env != NULL && strcmp(env, "mmap") == 0)
+        {
+            backend = DISK_BACKEND_MMAP;
+        }
+    }
+    /*The pread and mmap backends work on the descriptor under the stream,*/
+    /*which is never used for buffered I/O afterwards*/
+    fd = (backend == DISK_BACKEND_STDIO) ? -1 : fileno(fp);
+
+    /*Maps the whole image, blocks are then read and written in place*/
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        map = mmap(NULL, (size_t)MAX_BLOCK * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            printf("Could not map the disk file\n\n");
+            map = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*pread/pwrite until the whole range is transferred, the backend   */
+/*moves data straight between the file and the caller's buffer     */
+/*----------------------------------------------------------------*/
+static int pread_full(int file, char *buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pread(file, buffer, len, offset);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int file, const char *buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(file, buffer, len, offset);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*preadv/pwritev a run of blocks living in separate buffers, at    */
+/*most IOV_MAX blocks per call                                     */
+/*----------------------------------------------------------------*/
+static int transfer_vec(int start_address, int nblocks, void **buffers,
+                        int write)
+{
+    struct iovec iov[IOV_MAX];
+    int i, j, count;
+
+    for (i = 0; i < nblocks; i += count)
+    {
+        count = (nblocks - i < IOV_MAX) ? nblocks - i : IOV_MAX;
+        for (j = 0; j < count; j++)
+        {
+            iov[j].iov_base = buffers[i + j];
+            iov[j].iov_len = BLOCK_SIZE;
+        }
+        off_t offset = (off_t)(start_address + i) * BLOCK_SIZE;
+        device_transfer(write ? DISK_AIO_WRITE : DISK_AIO_READ,
+                        start_address + i, count);
+        ssize_t n = write ? pwritev(fd, iov, count, offset)
+                          : preadv(fd, iov, count, offset);
+        /*Falls back to one call per block on a short transfer*/
+        if (n != (ssize_t)count * BLOCK_SIZE)
+        {
+            for (j = 0; j < count; j++)
+            {
+                offset = (off_t)(start_address + i + j) * BLOCK_SIZE;
+                if ((write ? pwrite_full(fd, buffers[i + j], BLOCK_SIZE, offset)
+                           : pread_full(fd, buffers[i + j], BLOCK_SIZE, offset)) < 0)
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Asynchronous requests run on an io_uring instance when the kernel  */
+/*allows one, and on a pool of worker threads otherwise (or with     */
+/*DISK_EMU_AIO=threads in the environment). Both use the descriptor  */
+/*under the disk file, except that the stdio backend always uses the */
+/*pool, whose workers go through the stream so that its buffer stays */
+/*coherent. A memory mapped disk completes requests right away.      */
+/*Finished requests wait on a list until disk_aio_reap hands them    */
+/*back. The time the emulated device takes is paid by the workers,  */
+/*off the submitting thread, and for io_uring by the reaping thread, */
+/*so a request is only handed back without waiting once that time is */
+/*over. Several threads may reap at once, and submit meanwhile.      */
+/*------------------------------------------------------------------*/
+#define AIO_NONE 0
+#define AIO_URING 1
+#define AIO_THREADS 2
+#define AIO_URING_ENTRIES 64
+#define AIO_THREAD_COUNT 4
+
+static int aio_engine = AIO_NONE;
+static int aio_fd = -1;
+static int aio_in_flight = 0;
+static DiskAio *done_head = NULL;
+static DiskAio *done_tail = NULL;
+static int done_count = 0;
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_finished = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[AIO_THREAD_COUNT];
+static int worker_count = 0;
+static int aio_stopping = 0;
+static DiskAio *queue_head = NULL;
+static DiskAio *queue_tail = NULL;
+
+/*Runs a request synchronously*/
+static void aio_run(DiskAio *request)
+{
+    size_t len = (size_t)request->nblocks * BLOCK_SIZE;
+    off_t offset = (off_t)request->start_address * BLOCK_SIZE;
+    int status = 0;
+
+    if (NULL == map && backend == DISK_BACKEND_STDIO)
+    {
+        status = (request->op == DISK_AIO_WRITE)
+            ? write_blocks(request->start_address, request->nblocks,
+                           request->buffer)
+            : read_blocks(request->start_address, request->nblocks,
+                          request->buffer);
+        request->result = (status < 0) ? -1 : request->nblocks;
+        return;
+    }
+    device_transfer(request->op, request->start_address, request->nblocks);
+    if (NULL != map)
+    {
+        if (request->op == DISK_AIO_WRITE)
+        {
+            memcpy(map + offset, request->buffer, len);
+        }
+        else
+        {
+            memcpy(request->buffer, map + offset, len);
+        }
+    }
+    else if (request->op == DISK_AIO_WRITE)
+    {
+        status = pwrite_full(aio_fd, request->buffer, len, offset);
+    }
+    else
+    {
+        status = pread_full(aio_fd, request->buffer, len, offset);
+    }
+    request->result = (status < 0) ? -1 : request->nblocks;
+}
+
+/*Moves a request that is no longer in flight to the done list, done */
+/*is the point of the device's clock it is finished at               */
+static void aio_finish(DiskAio *request, long done)
+{
+    request->device_ns = done;
+    pthread_mutex_lock(&aio_lock);
+    request->next = NULL;
+    if (NULL == done_tail)
+    {
+        done_head = request;
+    }
+    else
+    {
+        done_tail->next = request;
+    }
+    done_tail = request;
+    done_count++;
+    aio_in_flight--;
+    pthread_cond_broadcast(&aio_finished);
+    pthread_mutex_unlock(&aio_lock);
+}
+
+static void *aio_worker(void *arg)
+{
+    DiskAio *request;
+
+    pthread_mutex_lock(&aio_lock);
+    while (1)
+    {
+        while (NULL == queue_head && !aio_stopping)
+        {
+            pthread_cond_wait(&aio_queued, &aio_lock);
+        }
+        /*Stops once the queue is empty*/
+        if (NULL == queue_head)
+        {
+            break;
+        }
+        request = queue_head;
+        queue_head = request->next;
+        if (NULL == queue_head)
+        {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&aio_lock);
+        /*Carries on from the submitting thread's simulated clock*/
+        simulated_ns = request->device_ns;
+        aio_run(request);
+        aio_finish(request, simulated_now());
+        pthread_mutex_lock(&aio_lock);
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return arg;
+}
+
+#ifdef HAVE_IO_URING
+static int ring_fd = -1;
+static void *sq_ring = NULL;
+static void *cq_ring = NULL;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+static struct io_uring_sqe *sqes = NULL;
+static struct io_uring_cqe *cqes = NULL;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static unsigned ring_entries;
+/*Guard the submission and the completion side of the ring. One     */
+/*thread at a time waits for completions, and only while some are due */
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void uring_teardown()
+{
+    if (NULL != sqes)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (NULL != cq_ring && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (NULL != sq_ring)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    sqes = NULL;
+    sq_ring = NULL;
+    cq_ring = NULL;
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+static void *map_ring(size_t size, off_t offset)
+{
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+/*Sets up the rings through the raw system calls, -1 when the kernel  */
+/*does not let the process use io_uring                               */
+static int uring_setup()
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, AIO_URING_ENTRIES, &params);
+    if (ring_fd < 0)
+    {
+        return -1;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes
+                   + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_ring_size > sq_ring_size)
+        {
+            sq_ring_size = cq_ring_size;
+        }
+        sq_ring = map_ring(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = sq_ring;
+    }
+    else
+    {
+        sq_ring = map_ring(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = map_ring(cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    sqes = (struct io_uring_sqe *)map_ring(sqes_size, IORING_OFF_SQES);
+    if (NULL == sq_ring || NULL == cq_ring || NULL == sqes)
+    {
+        uring_teardown();
+        return -1;
+    }
+
+    sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+    ring_entries = params.sq_entries;
+    return 0;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                      flags, NULL, 0);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+    return ret;
+}
+
+/*Moves the completions off the ring, after waiting for one of them   */
+/*when wait is set and any is in flight. Without it, nothing is done  */
+/*while another thread collects. Each request keeps the point the     */
+/*device is done with it at, which disk_aio_reap waits for. Failed and*/
+/*short transfers are redone synchronously, which also covers kernels */
+/*without IORING_OP_READ/WRITE.                                       */
+static void uring_collect(int wait)
+{
+    unsigned head;
+    int in_flight;
+
+    if (!wait)
+    {
+        if (pthread_mutex_trylock(&cq_lock) != 0)
+        {
+            return;
+        }
+    }
+    else
+    {
+        /*Requests in flight are only completed under cq_lock, so the */
+        /*kernel has one to hand back unless they were all collected  */
+        pthread_mutex_lock(&cq_lock);
+        pthread_mutex_lock(&aio_lock);
+        in_flight = aio_in_flight;
+        pthread_mutex_unlock(&aio_lock);
+        if (in_flight > 0)
+        {
+            uring_enter(0, 1);
+        }
+    }
+    head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        DiskAio *request = (DiskAio *)(uintptr_t)cqe->user_data;
+
+        if (cqe->res == request->nblocks * BLOCK_SIZE)
+        {
+            request->result = request->nblocks;
+            aio_finish(request, request->device_ns);
+        }
+        else
+        {
+            aio_run(request);
+            aio_finish(request, simulated_now());
+        }
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cq_lock);
+}
+
+static int uring_submit(DiskAio *request)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+
+    /*Keeps at most as many requests in flight as the ring has entries,*/
+    /*and counts this one before the kernel can complete it            */
+    pthread_mutex_lock(&aio_lock);
+    while (aio_in_flight >= (int)ring_entries)
+    {
+        pthread_mutex_unlock(&aio_lock);
+        uring_collect(1);
+        pthread_mutex_lock(&aio_lock);
+    }
+    aio_in_flight++;
+    pthread_mutex_unlock(&aio_lock);
+    pthread_mutex_lock(&sq_lock);
+    tail = *sq_tail;
+    index = tail & *sq_mask;
+    sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (request->op == DISK_AIO_WRITE) ? IORING_OP_WRITE
+                                                  : IORING_OP_READ;
+    sqe->fd = aio_fd;
+    sqe->addr = (uintptr_t)request->buffer;
+    sqe->len = request->nblocks * BLOCK_SIZE;
+    sqe->off = (off_t)request->start_address * BLOCK_SIZE;
+    sqe->user_data = (uintptr_t)request;
+    sq_array[index] = index;
+    count_transfer(request->op, request->nblocks);
+    request->device_ns = model_transfer(request->op, request->start_address,
+                                      request->nblocks);
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sq_lock);
+    return (uring_enter(1, 0) < 0) ? -1 : 0;
+}
+#endif
+
+/*Picks the engine for the open disk*/
+static void aio_start()
+{
+    char *env = getenv("DISK_EMU_AIO");
+
+    aio_fd = fileno(fp);
+#ifdef HAVE_IO_URING
+    if ((NULL == env || strcmp(env, "threads") != 0)
+        && backend != DISK_BACKEND_STDIO && uring_setup() == 0)
+    {
+        aio_engine = AIO_URING;
+        return;
+    }
+#endif
+    (void)env;
+    aio_engine = AIO_THREADS;
+    aio_stopping = 0;
+    for (worker_count = 0; worker_count < AIO_THREAD_COUNT; worker_count++)
+    {
+        if (pthread_create(&workers[worker_count], NULL, aio_worker, NULL))
+        {
+            break;
+        }
+    }
+}
+
+/*Waits for the requests in flight and stops the engine, requests that */
+/*were not reaped are forgotten                                        */
+static void aio_stop()
+{
+    int i;
+
+#ifdef HAVE_IO_URING
+    if (AIO_URING == aio_engine)
+    {
+        while (aio_in_flight > 0)
+        {
+            uring_collect(1);
+        }
+        uring_teardown();
+    }
+#endif
+    if (AIO_THREADS == aio_engine)
+    {
+        pthread_mutex_lock(&aio_lock);
+        aio_stopping = 1;
+        pthread_cond_broadcast(&aio_queued);
+        pthread_mutex_unlock(&aio_lock);
+        for (i = 0; i < worker_count; i++)
+        {
+            pthread_join(workers[i], NULL);
+        }
+        worker_count = 0;
+    }
+    done_head = NULL;
+    done_tail = NULL;
+    done_count = 0;
+    aio_in_flight = 0;
+    aio_engine = AIO_NONE;
+    aio_fd = -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Starts reading or writing a run of blocks, the request and its     */
+/*buffer must stay untouched until disk_aio_reap returns it          */
+/*------------------------------------------------------------------*/
+int disk_aio_submit(DiskAio *request)
+{
+    if (NULL == fp || request->start_address < 0
+        || request->start_address + request->nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", request->start_address);
+        return -1;
+    }
+
+    request->device_ns = simulated_ns;
+    pthread_mutex_lock(&aio_lock);
+    aio_in_flight++;
+    pthread_mutex_unlock(&aio_lock);
+    if (NULL == map && AIO_NONE == aio_engine)
+    {
+        aio_start();
+    }
+
+    /*Mapped blocks are copied right away, as are all blocks when no */
+    /*worker could be started                                        */
+    if (NULL != map || (AIO_THREADS == aio_engine && 0 == worker_count))
+    {
+        aio_run(request);
+        aio_finish(request, simulated_now());
+        return 0;
+    }
+#ifdef HAVE_IO_URING
+    if (AIO_URING == aio_engine)
+    {
+        pthread_mutex_lock(&aio_lock);
+        aio_in_flight--;
+        pthread_mutex_unlock(&aio_lock);
+        return uring_submit(request);
+    }
+#endif
+    pthread_mutex_lock(&aio_lock);
+    request->next = NULL;
+    if (NULL == queue_tail)
+    {
+        queue_head = request;
+    }
+    else
+    {
+        queue_tail->next = request;
+    }
+    queue_tail = request;
+    pthread_cond_signal(&aio_queued);
+    pthread_mutex_unlock(&aio_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Hands back up to max finished requests, after waiting until at     */
+/*least min of them are finished (or none is left in flight). Past   */
+/*the first min, only requests the device is already done with are   */
+/*handed back, so reaping without waiting never pauses.              */
+/*------------------------------------------------------------------*/
+int disk_aio_reap(DiskAio **completed, int max, int min)
+{
+    int i, n = 0;
+    long now;
+
+    if (min > max)
+    {
+        min = max;
+    }
+#ifdef HAVE_IO_URING
+    if (AIO_URING == aio_engine)
+    {
+        uring_collect(0);
+        pthread_mutex_lock(&aio_lock);
+        while (done_count < min && aio_in_flight > 0)
+        {
+            pthread_mutex_unlock(&aio_lock);
+            uring_collect(1);
+            pthread_mutex_lock(&aio_lock);
+        }
+        pthread_mutex_unlock(&aio_lock);
+    }
+#endif
+    pthread_mutex_lock(&aio_lock);
+    while (done_count < min && aio_in_flight > 0)
+    {
+        pthread_cond_wait(&aio_finished, &aio_lock);
+    }
+    now = simulated_now();
+    while (n < max && NULL != done_head
+           && (n < min || done_head->device_ns <= now))
+    {
+        completed[n++] = done_head;
+        done_head = done_head->next;
+        done_count--;
+    }
+    if (NULL == done_head)
+    {
+        done_tail = NULL;
+    }
+    pthread_mutex_unlock(&aio_lock);
+    for (i = 0; i < n; i++)
+    {
+        model_wait(completed[i]->device_ns);
+    }
+    return n;
+}
+
+/*Number of requests submitted and not reaped yet*/
+int disk_aio_pending()
+{
+    int n;
+
+    pthread_mutex_lock(&aio_lock);
+    n = aio_in_flight + done_count;
+    pthread_mutex_unlock(&aio_lock);
+    return n;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    aio_stop();
+    if(NULL != map)
+    {
+        msync(map, (size_t)MAX_BLOCK * BLOCK_SIZE, MS_SYNC);
+        munmap(map, (size_t)MAX_BLOCK * BLOCK_SIZE);
+        map = NULL;
+    }
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
+        fd = -1;
     }
     return 0;
 }
@@ -28,7 +1007,9 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
+    char *env = getenv("DISK_EMU_PREALLOCATE");
+    off_t size = (off_t)num_blocks * block_size;
+    int status;
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
@@ -44,15 +1025,26 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         return -1;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Extends the file to its given size, reading back as 0's. Blocks*/
+    /*only take space once written, unless preallocated              */
+    if (preallocate == -1)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        preallocate = (env != NULL && strcmp(env, "1") == 0);
     }
-    return 0;
+    status = ftruncate(fileno(fp), size);
+    if (status == 0 && preallocate)
+    {
+        status = posix_fallocate(fileno(fp), 0, size);
+    }
+    if (status != 0)
+    {
+        printf("Could not size disk file %s\n\n", filename);
+        fclose(fp);
+        fp = NULL;
+        return -1;
+    }
+    choose_model();
+    return choose_backend();
 }
 /*----------------------------*/
 /*Initializes an existing disk*/
@@ -70,6 +1062,63 @@ int init_disk(char *filename, int block_size, int num_blocks)
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+    choose_model();
+    return choose_backend();
+}
+
+/*------------------------------------------------------------------*/
+/*Returns where a block lives in the mapped image, or NULL when the  */
+/*disk is not memory mapped. Reads through the pointer see the       */
+/*current contents, writes must still go through write_blocks.       */
+/*------------------------------------------------------------------*/
+void *get_block_ptr(int block)
+{
+    if (NULL == map || block < 0 || block >= MAX_BLOCK)
+    {
+        return NULL;
+    }
+    return map + (size_t)block * BLOCK_SIZE;
+}
+
+/*------------------------------------------------------------------*/
+/*Same as get_block_ptr, for a block about to be read through the    */
+/*pointer: the read is counted and takes the time of the device      */
+/*model like one made with read_blocks                               */
+/*------------------------------------------------------------------*/
+void *read_block_ptr(int block)
+{
+    void *ptr = get_block_ptr(block);
+
+    if (NULL != ptr)
+    {
+        device_transfer(DISK_AIO_READ, block, 1);
+    }
+    return ptr;
+}
+
+/*------------------------------------------------------------------*/
+/*Makes the writes done so far durable in the disk file              */
+/*------------------------------------------------------------------*/
+int sync_disk()
+{
+    if (NULL != map)
+    {
+        return msync(map, (size_t)MAX_BLOCK * BLOCK_SIZE, MS_SYNC);
+    }
+    if (NULL != fp && backend == DISK_BACKEND_STDIO)
+    {
+        int status;
+
+        pthread_mutex_lock(&disk_lock);
+        status = fflush(fp);
+        pthread_mutex_unlock(&disk_lock);
+        return status;
+    }
+    /*Nothing is buffered in the process, the kernel writes its cache out*/
+    if (-1 != fd && backend == DISK_BACKEND_PREAD)
+    {
+        return fdatasync(fd);
+    }
     return 0;
 }
 
@@ -81,18 +1130,41 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
+    device_transfer(DISK_AIO_READ, start_address, nblocks);
+
+    /*Copies the run out of the mapped image*/
+    if (NULL != map)
+    {
+        memcpy(buffer, map + (size_t)start_address * BLOCK_SIZE,
+               (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*Reads the whole run straight into the caller's buffer*/
+    if (backend == DISK_BACKEND_PREAD)
+    {
+        if (pread_full(fd, buffer, (size_t)nblocks * BLOCK_SIZE,
+                       (off_t)start_address * BLOCK_SIZE) < 0)
+        {
+            printf("read error at block %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    /*Sets up a temporary buffer*/
+    void* blockRead = (void*) malloc(BLOCK_SIZE);
+
+    pthread_mutex_lock(&disk_lock);
 
     /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
@@ -102,6 +1174,7 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
     }
 
+    pthread_mutex_unlock(&disk_lock);
     free(blockRead);
     return s;
 }
@@ -114,30 +1187,115 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error\n");
         return -1;
     }
+    device_transfer(DISK_AIO_WRITE, start_address, nblocks);
+
+    /*Writes the whole run straight from the caller's buffer*/
+    if (backend != DISK_BACKEND_STDIO)
+    {
+        if (NULL != map)
+        {
+            memcpy(map + (size_t)start_address * BLOCK_SIZE, buffer,
+                   (size_t)nblocks * BLOCK_SIZE);
+            return nblocks;
+        }
+        if (pwrite_full(fd, buffer, (size_t)nblocks * BLOCK_SIZE,
+                        (off_t)start_address * BLOCK_SIZE) < 0)
+        {
+            printf("write error at block %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+
+    pthread_mutex_lock(&disk_lock);
 
     /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
         memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
 
         fwrite(blockWrite, BLOCK_SIZE, 1, fp);
         fflush(fp);
         s++;
     }
+    pthread_mutex_unlock(&disk_lock);
     free(blockWrite);
     return s;
 }
+
+/*------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into separate block buffers */
+/*------------------------------------------------------------------*/
+int read_blocks_vec(int start_address, int nblocks, void **buffers)
+{
+    int i;
+
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    if (backend == DISK_BACKEND_PREAD)
+    {
+        if (transfer_vec(start_address, nblocks, buffers, 0) < 0)
+        {
+            printf("read error at block %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    for (i = 0; i < nblocks; ++i)
+    {
+        if (read_blocks(start_address + i, 1, buffers[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from separate block buffers  */
+/*------------------------------------------------------------------*/
+int write_blocks_vec(int start_address, int nblocks, void **buffers)
+{
+    int i;
+
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    if (backend == DISK_BACKEND_PREAD)
+    {
+        if (transfer_vec(start_address, nblocks, buffers, 1) < 0)
+        {
+            printf("write error at block %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    for (i = 0; i < nblocks; ++i)
+    {
+        if (write_blocks(start_address + i, 1, buffers[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    return nblocks;
+}
@@ -1,5 +1,76 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#define DISK_BACKEND_STDIO 0
+#define DISK_BACKEND_PREAD 1
+#define DISK_BACKEND_MMAP 2
+
+#define DISK_AIO_READ 0
+#define DISK_AIO_WRITE 1
+
+/* an asynchronous transfer of a run of blocks, owned by disk_emu.c from
+   disk_aio_submit until disk_aio_reap hands it back */
+typedef struct disk_aio {
+    int op;              /* DISK_AIO_READ or DISK_AIO_WRITE */
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;          /* nblocks, or -1 on error */
+    void *data;          /* for the caller */
+    long device_ns;      /* emulated device time, for disk_emu.c */
+    struct disk_aio *next;
+} DiskAio;
+
+/* transfers that reached the backend since the last disk_reset_stats,
+   compiled out (always 0) with SFS_NO_STATS */
+typedef struct disk_stats {
+    long reads;
+    long writes;
+    long blocks_read;
+    long blocks_written;
+    long bytes_read;
+    long bytes_written;
+    long device_ns;      /* simulated time the device was busy */
+    long wait_ns;        /* simulated time transfers took, queueing included */
+} DiskStats;
+
+#define DISK_MODEL_NONE 0   /* transfers take no time */
+#define DISK_MODEL_FIXED 1  /* a fixed time per block */
+#define DISK_MODEL_HDD 2    /* a seek and half a revolution unless sequential */
+#define DISK_MODEL_SSD 3    /* a fixed time, queue_depth transfers at once */
+
+/* how long the emulated device takes to serve a transfer, see
+   disk_set_model in disk_emu.c */
+typedef struct disk_model {
+    int type;            /* DISK_MODEL_* */
+    double read_us;      /* FIXED: per block read, HDD and SSD: per read */
+    double write_us;     /* same for writes */
+    double seek_us;      /* HDD: seek across the whole disk */
+    double rotation_us;  /* HDD: one revolution */
+    int queue_depth;     /* SSD: transfers served at once */
+    double bandwidth;    /* MB/s shared by all transfers, 0 for no limit */
+    int simulate;        /* 1 to account the time without pausing */
+} DiskModel;
+
+int disk_set_backend(int backend);
+int disk_set_preallocate(int preallocate);
+int disk_set_latency(double microseconds);
+int disk_set_model(const DiskModel *new_model);
+int disk_model_by_name(const char *name, DiskModel *preset);
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+int sync_disk();
+void *get_block_ptr(int block);
+void *read_block_ptr(int block);
+int read_blocks_vec(int start_address, int nblocks, void **buffers);
+int write_blocks_vec(int start_address, int nblocks, void **buffers);
+int disk_aio_submit(DiskAio *request);
+int disk_aio_reap(DiskAio **completed, int max, int min);
+int disk_aio_pending();
+void disk_get_stats(DiskStats *stats);
+void disk_reset_stats();
+
+#endif
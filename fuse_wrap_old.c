@@ -1,6 +1,10 @@
 #define FUSE_USE_VERSION 30
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +17,51 @@
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* The operations below run on several FUSE worker threads at once (see */
+/* fuse_loop_workers), which sfs.c allows. open and create keep the SFS */
+/* fd in fi->fh for read, write and release. sfs.c hands out one fd per */
+/* file, shared by every open of it, so each fd counts its opens to be  */
+/* closed by the last release. Reads and writes pass their offset, and  */
+/* never move the fd's own. An unlinked file keeps its fd open until    */
+/* then, but every read and write on it fails.                          */
+#define MAX_HANDLES 4096
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 64
+
+static int opens[MAX_HANDLES];
+/* held while a name is bound to an fd, or unbound from it */
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+/* sfs_getnextfilename walks the directory with a single cursor */
+static pthread_mutex_t readdir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Opens the file for one more handle, -1 on failure */
+static int open_handle(const char *path)
+{
+    char filename[MAXFILENAME];
+    int fd;
+    
+    strcpy(filename, path);
+    pthread_mutex_lock(&handles_lock);
+    fd = sfs_fopen(filename);
+    if (fd >= MAX_HANDLES) {
+        /* never counted, so this was its only open */
+        sfs_fclose(fd);
+        fd = -1;
+    }
+    if (fd != -1)
+        opens[fd]++;
+    pthread_mutex_unlock(&handles_lock);
+    return fd;
+}
+
+static void close_handle(int fd)
+{
+    pthread_mutex_lock(&handles_lock);
+    if (--opens[fd] == 0)
+        sfs_fclose(fd);
+    pthread_mutex_unlock(&handles_lock);
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -44,9 +93,11 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     
+    pthread_mutex_lock(&readdir_lock);
     while(sfs_getnextfilename(file_name)) {
         filler(buf, &file_name[1], NULL, 0);
     }
+    pthread_mutex_unlock(&readdir_lock);
     
     return 0;
 }
@@ -57,7 +108,9 @@ static int fuse_unlink(const char *path)
     char filename[MAXFILENAME];
     
     strcpy(filename, path);
+    pthread_mutex_lock(&handles_lock);
     res = sfs_remove(filename);
+    pthread_mutex_unlock(&handles_lock);
     if (res == -1)
         return -errno;
     
@@ -66,83 +119,75 @@ static int fuse_unlink(const char *path)
 
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
-    int res;
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
+    int fd;
     
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    fd = open_handle(path);
+    if (fd == -1)
+        return -ENFILE;
     
-    sfs_fclose(res);
+    fi->fh = fd;
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    close_handle(fi->fh);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pread(fi->fh, buf, size, offset);
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_pwrite(fi->fh, buf, size, offset);
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
+/* Concurrent fsyncs share journal commits, see sfs_sync */
+static int fuse_fsync(const char *path, int isdatasync,
+        struct fuse_file_info *fi)
+{
+    if (sfs_fsync(fi->fh) == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+/* Empties the file in place, so that its open handles keep working */
 static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
-    int fd;
+    int fd = -1;
+    int res = -ENOENT;
     
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    pthread_mutex_lock(&handles_lock);
+    if (sfs_getfilesize(filename) != -1)
+        fd = sfs_fopen(filename);
+    if (fd != -1)
+        res = sfs_ftruncate(fd) == -1 ? -EIO : 0;
+    if (fd >= MAX_HANDLES || (fd != -1 && opens[fd] == 0))
+        sfs_fclose(fd);
+    pthread_mutex_unlock(&handles_lock);
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
-    return 0;
+    return res;
 }
 
 static int fuse_access(const char *path, int mask)
@@ -157,16 +202,21 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
     int fd;
     
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    fd = open_handle(path);
+    if (fd == -1)
+        return -ENFILE;
     
-    sfs_fclose(fd);
+    fp->fh = fd;
     return 0;
 }
 
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -174,14 +224,143 @@ static struct fuse_operations xmp_oper = {
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
     .write = fuse_write, 
+    .fsync = fuse_fsync,
     .access = fuse_access,
     .create = fuse_create,
+    .destroy = fuse_destroy,
+};
+
+/* Arguments of a worker thread, whose buffer holds one request */
+struct fuse_worker {
+    struct fuse_session *se;
+    char *buf;
+    size_t bufsize;
 };
 
+static sem_t loop_finished;
+
+static void *fuse_worker(void *arg)
+{
+    struct fuse_worker *w = (struct fuse_worker *) arg;
+    struct fuse_chan *ch = fuse_session_next_chan(w->se, NULL);
+    
+    while (!fuse_session_exited(w->se)) {
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf fbuf = {
+            .mem = w->buf,
+            .size = w->bufsize,
+        };
+        int res;
+        
+        /* only a worker waiting for a request may be cancelled, one in */
+        /* the middle of sfs.c could leave its locks held               */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(w->se, &fbuf, &tmpch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0)
+                fuse_session_exit(w->se);
+            break;
+        }
+        
+        fuse_session_process_buf(w->se, &fbuf, tmpch);
+    }
+    
+    sem_post(&loop_finished);
+    return NULL;
+}
+
+/* Same as fuse_loop_mt, but with a fixed number of worker threads */
+static int fuse_loop_workers(struct fuse *fuse, int workers)
+{
+    struct fuse_session *se = fuse_get_session(fuse);
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    struct fuse_worker w[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    sigset_t all, old;
+    int i, started;
+    
+    sem_init(&loop_finished, 0, 0);
+    
+    /* signals are left to this thread, whose handler ends the loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (started = 0; started < workers; started++) {
+        w[started].se = se;
+        w[started].bufsize = fuse_chan_bufsize(ch);
+        w[started].buf = malloc(w[started].bufsize);
+        if (w[started].buf == NULL ||
+            pthread_create(&threads[started], NULL, fuse_worker,
+                           &w[started]) != 0) {
+            free(w[started].buf);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    while (started > 0 && !fuse_session_exited(se))
+        sem_wait(&loop_finished);
+    
+    for (i = 0; i < started; i++)
+        pthread_cancel(threads[i]);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        free(w[i].buf);
+    }
+    sem_destroy(&loop_finished);
+    fuse_session_reset(se);
+    return started > 0 ? 0 : -1;
+}
+
+/* Takes --workers=N out of the arguments, DEFAULT_WORKERS without it */
+static int parse_workers(int *argc, char *argv[])
+{
+    int workers = DEFAULT_WORKERS;
+    int i, j;
+    
+    for (i = j = 0; i < *argc; i++) {
+        if (strncmp(argv[i], "--workers=", 10) == 0)
+            workers = atoi(argv[i] + 10);
+        else
+            argv[j++] = argv[i];
+    }
+    *argc = j;
+    argv[j] = NULL;
+    
+    if (workers < 1)
+        workers = 1;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+    return workers;
+}
+
+/* Runs the mount on --workers=N threads, or a single one with -s */
 int main(int argc, char *argv[])
 {
-  mksfs(0);
-  return fuse_main(argc, argv, &xmp_oper, NULL);
+    struct fuse *fuse;
+    char *mountpoint;
+    int multithreaded;
+    int workers;
+    int res;
+    
+    workers = parse_workers(&argc, argv);
+    
+    mksfs(0);
+    fuse = fuse_setup(argc, argv, &xmp_oper, sizeof(xmp_oper), &mountpoint,
+                      &multithreaded, NULL);
+    if (fuse == NULL)
+        return 1;
+    
+    if (multithreaded && workers > 1)
+        res = fuse_loop_workers(fuse, workers);
+    else
+        res = fuse_loop(fuse);
+    
+    fuse_teardown(fuse, mountpoint);
+    return res == -1 ? 1 : 0;
 }
@@ -5,243 +5,2076 @@
  * Root directory starts at the first block of the data block region.
  * The inode table, root directory and free byte map are brought into memory
  * when non fresh disk first initialized.
+ * Their changed blocks are committed to a journal that follows the inode
+ * table, and only written in place at checkpoints.
  */
 
 #include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "block_cache.h"
 #include "disk_emu.h"
-// #include "sfs_api.h"
+#include "sfs_api.h"
+#include "sfs_trace.h"
 
 #define MAXFILENAME 16
-#define BLOCK_SIZE 1024
-#define NO_FBM_BLOCKS 4  // Free byte map blocks
-#define MAX_BLOCK 1024 * NO_FBM_BLOCKS
 #define INODE_SIZE 56
-#define INODE_TABLE_SIZE 6  // 6 blocks for inode table
-#define MAX_FILE_NO 100
-#define DATA_BLOCK_START INODE_TABLE_SIZE + 1
-
-typedef struct inode {  // inode size : 56 bytes
-  int size;             // file size in bytes
-  int direct[12];       // a data block number
-  int indirect;         // an index block number
+#define NO_DIRECT_BLOCKS 10
+#define MAP_LEVELS 3  // single, double and triple indirect blocks
+#define PREALLOC_BLOCKS 16  // minimum size of a file's preallocation window
+#define READ_AHEAD_MIN 4    // blocks read ahead when a sequential read starts
+#define READ_AHEAD_MAX 64
+#define SFS_MAGIC 0xACBD0006
+#define SFS_VERSION 4
+#define LEGACY_MAGIC 0xACBD0005  // images with a free byte map of ints
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_CHECKPOINT_COMMITS 16  // commits between two checkpoints
+#define MAX_SYNC_DELAY 1000000         // microseconds
+
+// geometry used by mksfs, and by images older than version 2 which did not
+// record their number of inodes and free block map blocks
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 4096
+#define DEFAULT_NUM_INODES 100
+#define V1_FBM_BLOCKS 4
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+typedef struct inode {           // inode size : 56 bytes
+  int size;                      // file size in bytes
+  int direct[NO_DIRECT_BLOCKS];  // a data block number
+  int indirect[MAP_LEVELS];      // single, double and triple index blocks
 } Inode;
 
+// inode layout of images before version 3, with a single indirect block
+typedef struct inode_v2 {
+  int size;
+  int direct[12];
+  int indirect;
+} InodeV2;
+
 typedef struct superblock {
-  int magic;
-  int block_size;       // 1024 bytes
-  int fs_size;          // MAX_BLOCK
+  uint32_t magic;
+  int block_size;       // bytes per block
+  int fs_size;          // number of blocks on the disk
   int inode_table_len;  // number of inode blocks
   int root_inode;       // inode number of root directory
+  int version;          // on-disk format version, SFS_VERSION
+  int num_inodes;       // inodes and root directory entries, since version 2
+  int fbm_len;          // free block map blocks at the end, since version 2
+  int journal_start;    // first block of the journal, since version 4
+  int journal_len;      // journal blocks, 0 when the image has no journal
 } Superblock;
 
+// first block of the journal. It is followed by copies of the metadata
+// blocks it lists, in the same order. A list too long for one block goes on
+// in the blocks right after it, before the copies.
+typedef struct journal_header {
+  int magic;          // JOURNAL_MAGIC, anything else when the journal is empty
+  int count;          // number of blocks logged
+  uint32_t checksum;  // FNV-1a of the header and the logged blocks
+  int blocks[];       // the block each logged block is a copy of
+} JournalHeader;
+
 // file descriptor table entry
 typedef struct file {
   int inode_num;
   int offset;
+  // contiguous blocks reserved for the file's next writes, so that blocks
+  // written one after the other end up next to each other on disk
+  int prealloc_start;
+  int prealloc_len;
+  // physical blocks of the logical blocks looked up so far, -1 for the ones
+  // not known yet, so that translating them again needs no map walk
+  int *block_map;
+  int block_map_len;
+  // read-ahead state: the last logical block read, the first one not read
+  // ahead yet, and the read-ahead window in blocks (0 for random reads)
+  int ra_last;
+  int ra_next;
+  int ra_window;
+  // the last, partial block of the file while small appends fill it in
+  // memory, tail_block is its logical block or -1 when the buffer is unused
+  char *tail_buffer;
+  int tail_block;
+  // the file was removed while open, so its inode may already hold another
+  // file and closing it is the only operation left
+  bool removed;
+  pthread_mutex_t lock;  // held by the operation on the open file
 } File;
 
-typedef struct directory_entry {
-  bool used;
-  char file_name[MAXFILENAME];
-  int inode_num;
-} DirectoryEntry;
+typedef struct directory_entry {
+  bool used;
+  char file_name[MAXFILENAME];
+  int inode_num;
+} DirectoryEntry;
+
+// geometry of the mounted file system, derived from its superblock
+int block_size = DEFAULT_BLOCK_SIZE;
+int max_block = 0;           // number of blocks on the disk
+int fbm_blocks = 0;          // blocks reserved for the free block map
+int fbm_words = 0;           // the free block map is a packed bitmap
+int inode_table_blocks = 0;  // blocks of the inode table, from block 1
+int max_file_no = 0;         // inodes, root directory and FDT entries
+int root_dir_blocks = 0;     // blocks the root directory occupies on disk
+int ptrs_per_block = 0;      // block numbers held by an index block
+int max_file_blocks = 0;     // data blocks a single file can have
+int journal_start = 0;       // first block of the metadata journal
+int journal_blocks = 0;      // 0 when the image has no journal
+
+// index blocks along the last walk down a block map, one per level below the
+// inode, so that looking up nearby logical blocks needs no block reads
+typedef struct map_level {
+  int block_num;  // -1 when empty
+  bool dirty;     // entries changed since it was read
+  int *entries;
+} MapLevel;
+
+MapLevel map_path[MAP_LEVELS];
+// index blocks the last walk allocated, and the entries linking them, so that
+// they can be given back when the block they were allocated for cannot be
+int fresh_index[MAP_LEVELS];
+int *fresh_links[MAP_LEVELS];
+int no_fresh_index = 0;
+
+// the tables below are allocated at mount time. The metadata ones are
+// rounded up to whole blocks, so they move straight between memory and disk.
+Superblock superblock;
+File *FDT = NULL;
+Inode *inode_table = NULL;
+uint64_t *FBM = NULL;  // one bit per block, set when in use
+// blocks of the preallocation windows, which the allocator skips but the FBM
+// leaves free, so that a crash never leaks the unused part of a window
+uint64_t *prealloc_map = NULL;
+// blocks freed since the last commit, which the allocator skips too. Until
+// the commit lands a crash brings back the file holding them, so they must
+// not be written over.
+uint64_t *freed_map = NULL;
+int freed_count = 0;
+int fbm_hint = 0;  // word where the next free block search starts
+DirectoryEntry *root_dir = NULL;
+int next_file_index = 0;  // for sfs_getnextfilename
+
+// open addressing hash index from file names to root_dir entries, each slot
+// holds a root_dir index, DIR_SLOT_EMPTY or DIR_SLOT_DELETED
+#define DIR_SLOT_EMPTY -1
+#define DIR_SLOT_DELETED -2
+int *dir_index = NULL;
+int dir_index_size = 0;  // power of two, at least twice max_file_no
+int dir_index_deleted = 0;  // number of DIR_SLOT_DELETED slots
+
+// one dirty flag per on-disk block of the cached metadata, so that a flush
+// only writes the blocks that actually changed since the last one
+bool *inode_table_dirty = NULL;
+bool *FBM_dirty = NULL;
+bool *root_dir_dirty = NULL;
+
+// the transaction being committed to the journal: its header blocks, and the
+// blocks written with it. The logged blocks go in journal_buffers after room
+// for journal_header_max header blocks, and the header blocks a transaction
+// needs are put right before them when it is written. The dirty flags stay
+// set until the next checkpoint, so every commit logs all the blocks changed
+// since then and the last one alone is enough to replay.
+JournalHeader *journal = NULL;
+void **journal_buffers = NULL;
+int journal_header_max = 0;  // header blocks when all metadata is logged
+int journal_commits = 0;  // commits since the last checkpoint
+
+bool mounted = false;
+int cache_blocks = DEFAULT_CACHE_BLOCKS;  // capacity of the block cache
+
+// locks, always taken in this order:
+// - fs_lock: shared by every call, exclusive to mount and to flush metadata
+// - dir_lock: the root directory, its hash index and inode allocation
+// - fdt_lock: FDT entries being handed out and given back
+// - the lock of an FDT entry: its offset, read-ahead state, tail buffer and
+//   block map cache
+// - inode_locks: one per inode, for its inode table entry and its data, so
+//   that readers of a file run side by side and a writer runs alone
+// - alloc_lock: the FBM, the preallocation windows and the map path
+// sync_lock guards the group commit state below, and is never held while
+// taking any of them.
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t fdt_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t *inode_locks = NULL;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// group commit: every sfs_sync takes a ticket, and a single thread at a time
+// syncs on behalf of all the tickets handed out when it starts, while the
+// others wait for a sync covering theirs
+pthread_cond_t sync_done_cond = PTHREAD_COND_INITIALIZER;
+long sync_tickets = 0;   // tickets handed out
+long sync_covered = 0;   // tickets covered by a finished sync
+bool sync_running = false;
+int sync_status = 0;     // result of the last sync
+int sync_delay = 0;      // microseconds a sync waits for others to join it
+SyncStats sync_stats;
+// bumped by every change to file data or metadata, so a close finding it
+// where the last sync left it has nothing to write back
+long dirty_generation = 0;
+long synced_generation = 0;  // dirty_generation covered by the last sync
+
+// monotonic time in nanoseconds
+long clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+#ifndef SFS_NO_STATS
+// call and allocator statistics, updated with atomic adds since calls run
+// side by side. Every field is a long, so they are copied one by one.
+SfsStats stats;
+int scan_words = 0;  // FBM words looked at by the current search
+
+// account for an API call that took ns nanoseconds and returned result,
+// which are the bytes moved by reads and writes
+void count_call(int op, long ns, int result) {
+  SfsOpStats *op_stats = &stats.ops[op];
+  int bucket = 0;
+  while (bucket < SFS_LATENCY_BUCKETS - 1 && ns >= 1000L << bucket) {
+    bucket++;
+  }
+  __atomic_add_fetch(&op_stats->calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&op_stats->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&op_stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+  if (result < 0) {
+    __atomic_add_fetch(&op_stats->errors, 1, __ATOMIC_RELAXED);
+  } else if (op == SFS_OP_FREAD || op == SFS_OP_FWRITE) {
+    __atomic_add_fetch(&op_stats->bytes, result, __ATOMIC_RELAXED);
+  }
+}
+
+// account for a search of the FBM that looked at scan_words words, the
+// caller holds alloc_lock
+void count_scan() {
+  __atomic_add_fetch(&stats.alloc_searches, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.alloc_words, scan_words, __ATOMIC_RELAXED);
+  if (scan_words > __atomic_load_n(&stats.alloc_longest, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&stats.alloc_longest, scan_words, __ATOMIC_RELAXED);
+  }
+  scan_words = 0;
+}
+
+#define count_words(n) (scan_words += (n))
+#else
+#define count_scan()
+#define count_words(n)
+#endif
+
+// tracing, see sfs_trace.h. trace_file is NULL when calls are not traced,
+// records are written under trace_lock.
+FILE *trace_file = NULL;
+long trace_start = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the statistics each traced call counts in, -1 for none
+const int call_stats[TRACE_OPS] = {
+    SFS_OP_FOPEN, SFS_OP_FCLOSE, SFS_OP_FREAD, SFS_OP_FWRITE,
+    SFS_OP_FREAD, SFS_OP_FWRITE, -1,           SFS_OP_REMOVE,
+    -1,           -1,            SFS_OP_SYNC,  SFS_OP_SYNC,
+    -1};
+
+// an API call in progress, for the statistics and the trace
+typedef struct call {
+  int op;  // TRACE_*
+  long start;
+  int fd;
+  const char *name;
+  int offset;
+  int length;
+} Call;
+
+bool tracing() { return __atomic_load_n(&trace_file, __ATOMIC_RELAXED); }
+
+// start an API call, the clock is only read when the call is counted or
+// traced
+Call begin_call(int op, int fd, const char *name, int offset, int length) {
+  Call call = {op, 0, fd, name, offset, length};
+#ifdef SFS_NO_STATS
+  if (!tracing()) {
+    return call;
+  }
+#endif
+  call.start = clock_ns();
+  return call;
+}
+
+void trace_call(Call *call, long ns, int result) {
+  TraceRecord record;
+  int name_len = call->name == NULL ? 0 : strnlen(call->name, UINT8_MAX);
+  record.time_ns = call->start - trace_start;
+  record.latency_ns = ns < UINT32_MAX ? ns : UINT32_MAX;
+  record.fd = call->fd;
+  record.offset = call->offset;
+  record.length = call->length;
+  record.result = result;
+  record.op = call->op;
+  record.name_len = name_len;
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file != NULL) {
+    fwrite(&record, sizeof(record), 1, trace_file);
+    if (name_len > 0) {
+      fwrite(call->name, 1, name_len, trace_file);
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// finish an API call returning result
+int end_call(Call *call, int result) {
+  bool traced = tracing();
+#ifndef SFS_NO_STATS
+  long ns = clock_ns() - call->start;
+  if (call_stats[call->op] != -1) {
+    count_call(call_stats[call->op], ns, result);
+  }
+#else
+  long ns = traced ? clock_ns() - call->start : 0;
+#endif
+  if (traced) {
+    trace_call(call, ns, result);
+  }
+  return result;
+}
+
+int min(int x, int y) { return x < y ? x : y; }
+
+// mark the blocks covering bytes [offset, offset + len) of a metadata region,
+// inodes sharing a block may be marked by threads holding different locks
+void mark_dirty(bool *dirty, int no_blocks, int offset, int len) {
+  __atomic_add_fetch(&dirty_generation, 1, __ATOMIC_RELAXED);
+  for (int i = offset / block_size;
+       i <= (offset + len - 1) / block_size && i < no_blocks; i++) {
+    __atomic_store_n(&dirty[i], true, __ATOMIC_RELAXED);
+  }
+}
+
+void mark_inode_dirty(int inode_num) {
+  mark_dirty(inode_table_dirty, inode_table_blocks, inode_num * sizeof(Inode),
+             sizeof(Inode));
+}
+
+void mark_fbm_dirty(int block_num) {
+  mark_dirty(FBM_dirty, fbm_blocks, block_num / 8, 1);
+}
+
+void mark_root_dir_dirty(int index) {
+  mark_dirty(root_dir_dirty, root_dir_blocks, index * sizeof(DirectoryEntry),
+             sizeof(DirectoryEntry));
+}
+
+bool block_in_use(int block_num) {
+  return (FBM[block_num / 64] >> (block_num % 64)) & 1;
+}
+
+void set_block_used(int block_num) {
+  FBM[block_num / 64] |= (uint64_t)1 << (block_num % 64);
+  mark_fbm_dirty(block_num);
+}
+
+// blocks of a FBM word the allocator cannot hand out
+uint64_t busy_bits(int word) {
+  return FBM[word] | prealloc_map[word] | freed_map[word];
+}
+
+void set_block_preallocated(int block_num, bool prealloc) {
+  if (prealloc) {
+    prealloc_map[block_num / 64] |= (uint64_t)1 << (block_num % 64);
+  } else {
+    prealloc_map[block_num / 64] &= ~((uint64_t)1 << (block_num % 64));
+  }
+}
+
+// find the free block in FBM and allocate, the search scans 64 blocks at a
+// time and resumes from where the previous allocation left off
+int allocate_free_block() {
+  for (int n = 0; n < fbm_words; n++) {
+    int word = (fbm_hint + n) % fbm_words;
+    if (busy_bits(word) != UINT64_MAX) {
+      int block_num = word * 64 + __builtin_ctzll(~busy_bits(word));
+      set_block_used(block_num);
+      fbm_hint = word;
+      count_words(n + 1);
+      count_scan();
+      return block_num;
+    }
+  }
+  count_words(fbm_words);
+  count_scan();
+  return -1;
+}
+
+void free_block(int block_num) {
+  FBM[block_num / 64] &= ~((uint64_t)1 << (block_num % 64));
+  freed_map[block_num / 64] |= (uint64_t)1 << (block_num % 64);
+  freed_count++;
+  mark_fbm_dirty(block_num);
+}
+
+// hand the blocks freed so far to the allocator, once the FBM recording them
+// as free is committed
+void release_freed_blocks() {
+  if (freed_count > 0) {
+    memset(freed_map, 0, fbm_words * sizeof(uint64_t));
+    freed_count = 0;
+  }
+}
+
+// first free block at or after block_num, max_block if there is none
+int next_free_block(int block_num) {
+  if (block_num >= max_block) {
+    return max_block;
+  }
+  int word = block_num / 64;
+  uint64_t free_bits = ~busy_bits(word) & (UINT64_MAX << (block_num % 64));
+  count_words(1);
+  while (free_bits == 0) {
+    if (++word == fbm_words) {
+      return max_block;
+    }
+    free_bits = ~busy_bits(word);
+    count_words(1);
+  }
+  return word * 64 + __builtin_ctzll(free_bits);
+}
+
+// first used block at or after block_num, max_block if there is none
+int next_used_block(int block_num) {
+  if (block_num >= max_block) {
+    return max_block;
+  }
+  int word = block_num / 64;
+  uint64_t used_bits = busy_bits(word) & (UINT64_MAX << (block_num % 64));
+  count_words(1);
+  while (used_bits == 0) {
+    if (++word == fbm_words) {
+      return max_block;
+    }
+    used_bits = busy_bits(word);
+    count_words(1);
+  }
+  return word * 64 + __builtin_ctzll(used_bits);
+}
+
+// allocate a run of up to wanted contiguous blocks, searching from goal to
+// the end of the disk and then from the start. The first run long enough is
+// taken, otherwise the longest one found. A run for a preallocation window
+// (prealloc set) is only reserved in memory. Returns the first block of the
+// run and its length in got, or -1 when the disk is full.
+int allocate_free_run(int goal, int wanted, int *got, bool prealloc) {
+  int best_start = -1;
+  int best_len = 0;
+  for (int pass = 0; pass < 2 && best_len < wanted; pass++) {
+    int end = pass == 0 ? max_block : goal;
+    int block_num = next_free_block(pass == 0 ? goal : 0);
+    while (block_num < end) {
+      int run_end = min(next_used_block(block_num), end);
+      if (run_end - block_num > best_len) {
+        best_start = block_num;
+        best_len = min(run_end - block_num, wanted);
+        if (best_len == wanted) {
+          break;
+        }
+      }
+      block_num = next_free_block(run_end);
+    }
+  }
+
+  for (int i = 0; i < best_len; i++) {
+    if (prealloc) {
+      set_block_preallocated(best_start + i, true);
+    } else {
+      set_block_used(best_start + i);
+    }
+  }
+  if (best_len > 0) {
+    fbm_hint = (best_start + best_len) % max_block / 64;
+  }
+  count_scan();
+  *got = best_len;
+  return best_start;
+}
+
+// give the unused part of a file's preallocation window back
+void release_prealloc(int fileID) {
+  for (int i = 0; i < FDT[fileID].prealloc_len; i++) {
+    set_block_preallocated(FDT[fileID].prealloc_start + i, false);
+  }
+  FDT[fileID].prealloc_len = 0;
+}
+
+// allocate the data block following prev_block (-1 for the first block of a
+// file) from the file's preallocation window. An empty window is refilled
+// with at least the wanted number of blocks, placed right after prev_block
+// when that space is free. Files that are not open (fileID -1, such as the
+// root directory) get single blocks at the same place instead.
+int allocate_data_block(int fileID, int prev_block, int wanted) {
+  int goal = prev_block == -1 ? fbm_hint * 64 : (prev_block + 1) % max_block;
+  if (fileID == -1) {
+    int got;
+    return allocate_free_run(goal, 1, &got, false);
+  }
+
+  File *file = &FDT[fileID];
+  if (file->prealloc_len == 0) {
+    int want = min(wanted > PREALLOC_BLOCKS ? wanted : PREALLOC_BLOCKS,
+                   max_file_blocks);
+    file->prealloc_start =
+        allocate_free_run(goal, want, &file->prealloc_len, true);
+    if (file->prealloc_start == -1) {
+      // the disk is full, but other open files may still hold reserved blocks
+      for (int i = 0; i < max_file_no; i++) {
+        if (FDT[i].inode_num != -1) {
+          release_prealloc(i);
+        }
+      }
+      file->prealloc_start =
+          allocate_free_run(goal, 1, &file->prealloc_len, true);
+      if (file->prealloc_start == -1) {
+        return -1;
+      }
+    }
+  }
+  // the window is only reserved in memory, its blocks are used once handed
+  // out
+  set_block_preallocated(file->prealloc_start, false);
+  set_block_used(file->prealloc_start);
+  file->prealloc_len--;
+  return file->prealloc_start++;
+}
+
+// write the dirty blocks of a region stored contiguously on disk starting at
+// start_block, adjacent dirty blocks are written with a single call
+void flush_region(int start_block, char *region, bool *dirty, int no_blocks) {
+  int i = 0;
+  while (i < no_blocks) {
+    if (!dirty[i]) {
+      i++;
+      continue;
+    }
+    int run_start = i;
+    while (i < no_blocks && dirty[i]) {
+      dirty[i] = false;
+      i++;
+    }
+    cache_write_blocks(start_block + run_start, i - run_start,
+                       region + (size_t)run_start * block_size);
+  }
+}
+
+// contents of a block for reading only: a pointer straight into the image
+// when the disk is memory mapped, otherwise a copy read into buffer
+char *peek_block(int block_num, char *buffer) {
+  char *block = (char *)read_block_ptr(block_num);
+  if (block == NULL) {
+    cache_read_blocks(block_num, 1, buffer);
+    block = buffer;
+  }
+  return block;
+}
+
+int find_no_file_blocks(int size) {
+  int no_blocks = size / block_size;
+  if (size % block_size != 0) {
+    no_blocks++;
+  }
+  return no_blocks;
+}
+
+// write back the index blocks of the map path that were changed
+void flush_map_path() {
+  for (int level = 0; level < MAP_LEVELS; level++) {
+    if (map_path[level].dirty) {
+      cache_write_blocks(map_path[level].block_num, 1,
+                         map_path[level].entries);
+      map_path[level].dirty = false;
+    }
+  }
+}
+
+// forget the map path, once index blocks may have been freed
+void invalidate_map_path() {
+  flush_map_path();
+  for (int level = 0; level < MAP_LEVELS; level++) {
+    map_path[level].block_num = -1;
+  }
+}
+
+// make block_num the index block of the map path at the given level, reading
+// it unless it is a new one, which starts with every entry unallocated
+void set_map_level(int level, int block_num, bool fresh) {
+  MapLevel *map_level = &map_path[level];
+  if (map_level->block_num == block_num && !fresh) {
+    return;
+  }
+  if (map_level->dirty) {
+    cache_write_blocks(map_level->block_num, 1, map_level->entries);
+  }
+  map_level->block_num = block_num;
+  map_level->dirty = fresh;
+  if (fresh) {
+    for (int i = 0; i < ptrs_per_block; i++) {
+      map_level->entries[i] = -1;
+    }
+  } else {
+    cache_read_blocks(block_num, 1, map_level->entries);
+  }
+}
+
+// free the index blocks the last walk allocated, once no block could be
+// allocated below them. Nothing past the size of the file is freed with it
+// (see free_map_tree), so they would be lost otherwise.
+void undo_map_entry() {
+  while (no_fresh_index > 0) {
+    no_fresh_index--;
+    for (int level = 0; level < MAP_LEVELS; level++) {
+      if (map_path[level].block_num == fresh_index[no_fresh_index]) {
+        map_path[level].block_num = -1;
+        map_path[level].dirty = false;
+      }
+    }
+    *fresh_links[no_fresh_index] = -1;
+    free_block(fresh_index[no_fresh_index]);
+  }
+}
+
+// find the block map entry of a logical block: a direct pointer of the inode,
+// or an entry in the index block at the given leaf level of the map path.
+// Missing index blocks are allocated when allocate is set, otherwise NULL is
+// returned for them. The entry stays valid until the next walk.
+//
+// Index blocks are written in place, not journaled, so after a crash they may
+// map blocks appended after the last commit, which its FBM has as free. Files
+// have no holes, so when allocating past the blocks the size of the file
+// covers, the entry of the block and the index blocks of the subtrees it
+// starts can only be such leftovers, and are not trusted. An index block the
+// inode points to is still the file's, since inodes are journaled.
+int *map_entry(Inode *inode, int lblk, bool allocate, int *leaf) {
+  *leaf = -1;
+  no_fresh_index = 0;
+  if (lblk < NO_DIRECT_BLOCKS) {
+    return &inode->direct[lblk];
+  }
+  if (lblk >= max_file_blocks) {
+    return NULL;
+  }
+  bool appended = allocate && lblk >= find_no_file_blocks(inode->size);
+
+  // the tree holding the block, and the offset of the block in it
+  long rel = lblk - NO_DIRECT_BLOCKS;
+  long span = ptrs_per_block;
+  int depth = 1;
+  while (rel >= span) {
+    rel -= span;
+    span *= ptrs_per_block;
+    depth++;
+  }
+
+  int *entry = &inode->indirect[depth - 1];
+  for (int level = 0; level < depth; level++) {
+    // rel is the offset of the block in the subtree of this level
+    bool starts_subtree = appended && rel == 0;
+    if (starts_subtree && level > 0) {
+      *entry = -1;
+    }
+    if (*entry == -1) {
+      if (!allocate) {
+        return NULL;
+      }
+      int block_num = allocate_free_block();
+      if (block_num == -1) {
+        printf("error for index block allocation\n");
+        undo_map_entry();
+        return NULL;
+      }
+      *entry = block_num;
+      fresh_index[no_fresh_index] = block_num;
+      fresh_links[no_fresh_index] = entry;
+      no_fresh_index++;
+      if (level > 0) {
+        map_path[level - 1].dirty = true;
+      }
+      set_map_level(level, block_num, true);
+    } else {
+      set_map_level(level, *entry, starts_subtree);
+    }
+    span /= ptrs_per_block;
+    entry = &map_path[level].entries[rel / span];
+    rel %= span;
+  }
+  *leaf = depth - 1;
+  if (appended) {
+    *entry = -1;
+  }
+  return entry;
+}
+
+// physical block backing a logical block of an inode, -1 if not allocated
+int lookup_block(Inode *inode, int lblk) {
+  int leaf;
+  int *entry = map_entry(inode, lblk, false, &leaf);
+  return entry == NULL ? -1 : *entry;
+}
+
+// physical block of a logical block in the block map cache of the file open
+// as fileID, -1 when it is not known (or the file is not open, fileID -1)
+int cached_block(int fileID, int lblk) {
+  if (fileID == -1 || lblk >= FDT[fileID].block_map_len) {
+    return -1;
+  }
+  return FDT[fileID].block_map[lblk];
+}
+
+// remember the physical block of a logical block of an open file, growing
+// its block map cache as needed
+void cache_block_mapping(int fileID, int lblk, int block_num) {
+  if (fileID == -1) {
+    return;
+  }
+  File *file = &FDT[fileID];
+  if (lblk >= file->block_map_len) {
+    int len = file->block_map_len > 0 ? file->block_map_len : 64;
+    while (len <= lblk) {
+      len *= 2;
+    }
+    int *block_map = (int *)realloc(file->block_map, len * sizeof(int));
+    if (block_map == NULL) {
+      return;  // it is only a cache
+    }
+    for (int i = file->block_map_len; i < len; i++) {
+      block_map[i] = -1;
+    }
+    file->block_map = block_map;
+    file->block_map_len = len;
+  }
+  file->block_map[lblk] = block_num;
+}
+
+// forget the block map cache of an open file, once its blocks are freed
+void drop_block_map(int fileID) {
+  free(FDT[fileID].block_map);
+  FDT[fileID].block_map = NULL;
+  FDT[fileID].block_map_len = 0;
+}
+
+// physical block backing a logical block, through the block map cache of the
+// file open as fileID when there is one
+int translate_block(int fileID, Inode *inode, int lblk) {
+  int block_num = cached_block(fileID, lblk);
+  if (block_num == -1) {
+    pthread_mutex_lock(&alloc_lock);
+    block_num = lookup_block(inode, lblk);
+    pthread_mutex_unlock(&alloc_lock);
+    if (block_num != -1) {
+      cache_block_mapping(fileID, lblk, block_num);
+    }
+  }
+  return block_num;
+}
+
+// look up the physical blocks backing logical blocks [first, first + count)
+// of an inode open as fileID (-1 for one that is not open), -1 for the ones
+// not allocated
+void map_file_blocks(int fileID, Inode *inode, int first, int count,
+                     int *blocks) {
+  for (int i = 0; i < count; i++) {
+    blocks[i] = translate_block(fileID, inode, first + i);
+  }
+}
+
+// same as map_file_blocks, but the missing blocks (and index blocks) are
+// allocated for the file. Returns the number of blocks mapped, which is less
+// than count when the disk is full.
+int allocate_file_blocks(int fileID, Inode *inode, int first, int count,
+                         int *blocks) {
+  // place each block after the one holding the previous logical block
+  int prev_block = first > 0 ? translate_block(fileID, inode, first - 1) : -1;
+  int i;
+  pthread_mutex_lock(&alloc_lock);
+  for (i = 0; i < count; i++) {
+    blocks[i] = cached_block(fileID, first + i);
+    if (blocks[i] != -1) {
+      prev_block = blocks[i];
+      continue;
+    }
+
+    int leaf;
+    int *entry = map_entry(inode, first + i, true, &leaf);
+    if (entry == NULL) {
+      break;
+    }
+    if (*entry == -1) {
+      *entry = allocate_data_block(fileID, prev_block, count - i);
+      if (*entry == -1) {
+        printf("error for data block allocation\n");
+        undo_map_entry();
+        break;
+      }
+      if (leaf >= 0) {
+        map_path[leaf].dirty = true;
+      }
+    }
+    blocks[i] = *entry;
+    prev_block = *entry;
+    cache_block_mapping(fileID, first + i, *entry);
+  }
+  flush_map_path();
+  pthread_mutex_unlock(&alloc_lock);
+  return i;
+}
+
+// free an index block with the given number of index levels (1 for a single
+// indirect block) and every block below it that maps one of the first
+// no_blocks logical blocks of the file, first being the first logical block
+// of the subtree. Entries past those can be left over from a crash (see
+// map_entry) and are skipped.
+void free_map_tree(int block_num, int depth, long first, int no_blocks) {
+  long span = 1;
+  for (int level = 1; level < depth; level++) {
+    span *= ptrs_per_block;
+  }
+  int index_buffer[ptrs_per_block];
+  int *index_block = (int *)peek_block(block_num, (char *)&index_buffer);
+  for (int i = 0; i < ptrs_per_block && first + i * span < no_blocks; i++) {
+    if (index_block[i] == -1) {
+      continue;
+    }
+    if (depth == 1) {
+      free_block(index_block[i]);
+    } else {
+      free_map_tree(index_block[i], depth - 1, first + i * span, no_blocks);
+    }
+  }
+  free_block(block_num);
+}
+
+// free every block of a file, leaving it empty. The caller holds its inode
+// lock exclusively and alloc_lock.
+void free_file_blocks(int inode_num) {
+  Inode *inode = &inode_table[inode_num];
+  for (int i = 0; i < NO_DIRECT_BLOCKS; i++) {
+    if (inode->direct[i] != -1) {
+      free_block(inode->direct[i]);
+      inode->direct[i] = -1;
+    }
+  }
+
+  // free the index blocks of the file along with the blocks they point to
+  invalidate_map_path();
+  int no_blocks = find_no_file_blocks(inode->size);
+  long first = NO_DIRECT_BLOCKS;
+  long span = ptrs_per_block;
+  for (int level = 0; level < MAP_LEVELS; level++) {
+    if (inode->indirect[level] != -1) {
+      free_map_tree(inode->indirect[level], level + 1, first, no_blocks);
+      inode->indirect[level] = -1;
+    }
+    first += span;
+    span *= ptrs_per_block;
+  }
+  inode->size = 0;
+  mark_inode_dirty(inode_num);
+}
+
+// move length bytes between buf and the file blocks listed in blocks, starting
+// offset bytes into the first one. Runs of physically adjacent blocks are
+// transferred with a single call, and whole blocks go straight from/to buf.
+// Only a partially written block needs its old contents, which are read back
+// unless the block is one of the new ones from index fresh_from onwards.
+int transfer_file_blocks(int *blocks, int no_blocks, int offset, int length,
+                         char *buf, bool write, int fresh_from) {
+  char block_buffer[block_size];
+  int done = 0;
+  int i = 0;
+  while (i < no_blocks && done < length) {
+    if (blocks[i] == -1) {
+      break;
+    }
+    int run = 1;
+    while (i + run < no_blocks && blocks[i + run] == blocks[i] + run) {
+      run++;
+    }
+
+    // byte range [start, end) of the run covered by this transfer
+    int start = i == 0 ? offset : 0;
+    int end = min(run * block_size, start + length - done);
+    while (start < end) {
+      int block_num = blocks[i] + start / block_size;
+      int within = start % block_size;
+      int whole = within == 0 ? (end - start) / block_size : 0;
+      if (whole > 0) {
+        if (write) {
+          cache_write_blocks(block_num, whole, buf + done);
+        } else {
+          cache_read_blocks(block_num, whole, buf + done);
+        }
+        start += whole * block_size;
+        done += whole * block_size;
+        continue;
+      }
+
+      // a partial block at either end of the run
+      int n = min(block_size - within, end - start);
+      if (!write) {
+        memcpy(buf + done, peek_block(block_num, block_buffer) + within, n);
+      } else {
+        if (i + start / block_size < fresh_from) {
+          cache_read_blocks(block_num, 1, block_buffer);
+        } else {
+          memset(block_buffer, 0, block_size);
+        }
+        memcpy(block_buffer + within, buf + done, n);
+        cache_write_blocks(block_num, 1, block_buffer);
+      }
+      start += n;
+      done += n;
+    }
+    i += run;
+  }
+  return done;
+}
+
+// write the tail buffer of an open file to the block it holds
+void flush_tail(int fileID) {
+  File *file = &FDT[fileID];
+  if (file->tail_block == -1) {
+    return;
+  }
+  // buffer_append allocated the block when the buffer started on it
+  int block_num =
+      translate_block(fileID, &inode_table[file->inode_num], file->tail_block);
+  cache_write_blocks(block_num, 1, file->tail_buffer);
+  file->tail_block = -1;
+}
+
+// append to an open file through its tail buffer, so that a run of small
+// appends costs a single block write once the block is full. Returns false,
+// without buffering anything, unless the write at offset is an append that
+// leaves the last block of the file partial.
+bool buffer_append(int fileID, const char *buf, int length, int offset) {
+  File *file = &FDT[fileID];
+  Inode *inode = &inode_table[file->inode_num];
+  int lblk = offset / block_size;
+  int within = offset % block_size;
+  if (length <= 0 || offset != inode->size ||
+      within + length >= block_size || lblk >= max_file_blocks) {
+    return false;
+  }
+
+  if (file->tail_block != lblk) {
+    flush_tail(fileID);
+    if (file->tail_buffer == NULL) {
+      file->tail_buffer = (char *)malloc(block_size);
+      if (file->tail_buffer == NULL) {
+        return false;
+      }
+    }
+    // start from the current contents of the block, which the file only has
+    // when its size ends inside it. A new block is allocated right away, so
+    // that a full disk fails this append rather than the write of the buffer,
+    // once the data was acknowledged.
+    int block_num;
+    if (within > 0) {
+      block_num = translate_block(fileID, inode, lblk);
+      cache_read_blocks(block_num, 1, file->tail_buffer);
+    } else if (allocate_file_blocks(fileID, inode, lblk, 1, &block_num) == 1) {
+      memset(file->tail_buffer, 0, block_size);
+    } else {
+      return false;
+    }
+    file->tail_block = lblk;
+  }
+
+  memcpy(file->tail_buffer + within, buf, length);
+  inode->size = offset + length;
+  mark_inode_dirty(file->inode_num);
+  return true;
+}
+
+// the tail buffers go away when their files are closed or removed
+void drop_tail(int fileID) {
+  free(FDT[fileID].tail_buffer);
+  FDT[fileID].tail_buffer = NULL;
+  FDT[fileID].tail_block = -1;
+}
+
+// blocks taken by a journal header listing count blocks
+int journal_header_blocks(int size, int count) {
+  long bytes = sizeof(JournalHeader) + (long)count * sizeof(int);
+  return (bytes + size - 1) / size;
+}
+
+// add a metadata block to the journal transaction, data is its contents
+void log_block(int block_num, void *data) {
+  journal_buffers[journal_header_max + journal->count] = data;
+  journal->blocks[journal->count++] = block_num;
+}
+
+// log the dirty blocks of a region stored contiguously on disk starting at
+// start_block, the counterpart of flush_region
+void log_region(int start_block, char *region, bool *dirty, int no_blocks) {
+  for (int i = 0; i < no_blocks; i++) {
+    if (dirty[i]) {
+      log_block(start_block + i, region + (size_t)i * block_size);
+    }
+  }
+}
+
+// the root directory is stored like the data of a file, in the blocks mapped
+// by the root inode, which are allocated when missing. Its dirty blocks are
+// written in place, or only logged to the journal transaction.
+void flush_root_dir(bool log) {
+  Inode root_inode = inode_table[superblock.root_inode];
+  // images written before the root directory was persisted have a zero sized
+  // root inode with only its first block allocated
+  root_inode.size = max_file_no * sizeof(DirectoryEntry);
+
+  int first_dirty = 0;
+  while (first_dirty < root_dir_blocks && !root_dir_dirty[first_dirty]) {
+    first_dirty++;
+  }
+  if (first_dirty < root_dir_blocks) {
+    int blocks[root_dir_blocks];
+    int mapped =
+        allocate_file_blocks(-1, &root_inode, 0, root_dir_blocks, blocks);
+    for (int i = first_dirty; i < mapped; i++) {
+      if (root_dir_dirty[i] && log) {
+        log_block(blocks[i], (char *)root_dir + i * block_size);
+      } else if (root_dir_dirty[i]) {
+        cache_write_blocks(blocks[i], 1, (char *)root_dir + i * block_size);
+        root_dir_dirty[i] = false;
+      }
+    }
+  }
+
+  if (memcmp(&inode_table[superblock.root_inode], &root_inode,
+             sizeof(Inode)) != 0) {
+    inode_table[superblock.root_inode] = root_inode;
+    mark_inode_dirty(superblock.root_inode);
+  }
+}
+
+// FNV-1a hash of the nblocks blocks of a transaction, header included
+uint32_t journal_checksum(void **buffers, int nblocks) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < nblocks; i++) {
+    unsigned char *block = buffers[i];
+    for (int j = 0; j < block_size; j++) {
+      hash = (hash ^ block[j]) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+// write the file data in the cache to the disk, then commit every metadata
+// block changed since the last checkpoint to the journal with one sequential
+// write. A transaction cut short by a crash fails its checksum and is not
+// replayed, so the metadata on disk moves from one sync to the next at once.
+int commit_journal() {
+  memset(journal, 0, (size_t)journal_header_max * block_size);
+  flush_root_dir(true);
+  log_region(1, (char *)inode_table, inode_table_dirty, inode_table_blocks);
+  log_region(max_block - fbm_blocks, (char *)FBM, FBM_dirty, fbm_blocks);
+  // the logged blocks may point to data blocks, which go first
+  if (cache_flush() < 0 || sync_disk() < 0) {
+    return -1;
+  }
+  if (journal->count == 0) {
+    return 0;
+  }
+
+  journal->magic = JOURNAL_MAGIC;
+  int header_blocks = journal_header_blocks(block_size, journal->count);
+  void **buffers = journal_buffers + journal_header_max - header_blocks;
+  for (int i = 0; i < header_blocks; i++) {
+    buffers[i] = (char *)journal + (size_t)i * block_size;
+  }
+  int nblocks = header_blocks + journal->count;
+  journal->checksum = journal_checksum(buffers, nblocks);
+  if (write_blocks_vec(journal_start, nblocks, buffers) < 0 ||
+      sync_disk() < 0) {
+    return -1;
+  }
+  journal_commits++;
+  return 0;
+}
+
+// write the dirty metadata blocks in place, after they were committed to the
+// journal when there is one, and empty the journal once they are on disk.
+// An empty journal needs no sync, replaying the last transaction again only
+// writes what the blocks already hold.
+int checkpoint_fs() {
+  flush_root_dir(false);
+  flush_region(1, (char *)inode_table, inode_table_dirty, inode_table_blocks);
+  flush_region(max_block - fbm_blocks, (char *)FBM, FBM_dirty, fbm_blocks);
+  if (cache_flush() < 0 || sync_disk() < 0) {
+    return -1;
+  }
+  if (journal_commits > 0) {
+    memset(journal, 0, block_size);
+    journal_commits = 0;
+    return write_blocks(journal_start, 1, journal) < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+// write back the tail buffers of the open files and every dirty metadata
+// block. The root directory goes first since growing it may dirty the inode
+// table and the free byte map. With a journal the metadata is only committed
+// to it, and written in place every JOURNAL_CHECKPOINT_COMMITS commits or
+// when checkpoint is set. The caller holds fs_lock exclusively.
+int sync_fs(bool checkpoint) {
+  if (!mounted) {
+    return -1;
+  }
+  for (int i = 0; i < max_file_no; i++) {
+    if (FDT[i].inode_num != -1) {
+      flush_tail(i);
+    }
+  }
+  if (journal_blocks > 0) {
+    if (commit_journal() < 0) {
+      return -1;
+    }
+    release_freed_blocks();
+    if (!checkpoint && journal_commits < JOURNAL_CHECKPOINT_COMMITS) {
+      return 0;
+    }
+  }
+  if (checkpoint_fs() < 0) {
+    return -1;
+  }
+  release_freed_blocks();
+  return 0;
+}
+
+// the first caller to find no sync running waits sync_delay for others to
+// join, then syncs once for every caller so far. Callers arriving meanwhile
+// wait, and the next sync covers them all.
+int group_sync() {
+  pthread_mutex_lock(&sync_lock);
+  long ticket = ++sync_tickets;
+  sync_stats.requests++;
+  while (sync_covered < ticket) {
+    if (sync_running) {
+      pthread_cond_wait(&sync_done_cond, &sync_lock);
+      continue;
+    }
+    sync_running = true;
+    if (sync_delay > 0) {
+      pthread_mutex_unlock(&sync_lock);
+      usleep(sync_delay);
+      pthread_mutex_lock(&sync_lock);
+    }
+    long covered = sync_tickets;
+    pthread_mutex_unlock(&sync_lock);
+
+    // every change counted so far is made, since changes hold fs_lock
+    pthread_rwlock_wrlock(&fs_lock);
+    long generation = __atomic_load_n(&dirty_generation, __ATOMIC_RELAXED);
+    int status = sync_fs(false);
+    pthread_rwlock_unlock(&fs_lock);
+
+    pthread_mutex_lock(&sync_lock);
+    if (status == 0) {
+      synced_generation = generation;
+    }
+    sync_stats.commits++;
+    sync_stats.batched += covered - sync_covered;
+    sync_covered = covered;
+    sync_status = status;
+    sync_running = false;
+    pthread_cond_broadcast(&sync_done_cond);
+  }
+  int status = sync_status;
+  pthread_mutex_unlock(&sync_lock);
+  return status;
+}
+
+// whether anything changed since the last sync that succeeded
+bool changed_since_sync() {
+  pthread_mutex_lock(&sync_lock);
+  bool changed =
+      __atomic_load_n(&dirty_generation, __ATOMIC_RELAXED) != synced_generation;
+  pthread_mutex_unlock(&sync_lock);
+  return changed;
+}
+
+int sfs_sync() {
+  Call call = begin_call(TRACE_SYNC, -1, NULL, -1, -1);
+  return end_call(&call, group_sync());
+}
+
+// takes effect at the next sfs_sync, 0 syncs right away
+void sfs_set_sync_delay(int microseconds) {
+  if (microseconds >= 0 && microseconds <= MAX_SYNC_DELAY) {
+    pthread_mutex_lock(&sync_lock);
+    sync_delay = microseconds;
+    pthread_mutex_unlock(&sync_lock);
+  }
+}
+
+void sfs_get_sync_stats(SyncStats *stats) {
+  pthread_mutex_lock(&sync_lock);
+  *stats = sync_stats;
+  pthread_mutex_unlock(&sync_lock);
+}
+
+void sfs_reset_sync_stats() {
+  pthread_mutex_lock(&sync_lock);
+  memset(&sync_stats, 0, sizeof(sync_stats));
+  pthread_mutex_unlock(&sync_lock);
+}
+
+// the counters of sfs.c are the longs before the disk statistics
+#define STAT_LONGS (offsetof(SfsStats, disk) / sizeof(long))
+
+void sfs_get_stats(SfsStats *copy) {
+  memset(copy, 0, sizeof(*copy));
+#ifndef SFS_NO_STATS
+  for (size_t i = 0; i < STAT_LONGS; i++) {
+    ((long *)copy)[i] = __atomic_load_n(&((long *)&stats)[i], __ATOMIC_RELAXED);
+  }
+#endif
+  disk_get_stats(&copy->disk);
+  cache_get_stats(&copy->cache);
+  sfs_get_sync_stats(&copy->sync);
+}
+
+void sfs_reset_stats() {
+#ifndef SFS_NO_STATS
+  for (size_t i = 0; i < STAT_LONGS; i++) {
+    __atomic_store_n(&((long *)&stats)[i], 0, __ATOMIC_RELAXED);
+  }
+#endif
+  disk_reset_stats();
+  cache_reset_stats();
+  sfs_reset_sync_stats();
+}
+
+// upper bound in microseconds of the histogram bucket where the given
+// fraction of the calls is reached, 0 without calls
+long latency_percentile(const SfsOpStats *op_stats, double fraction) {
+  if (op_stats->calls == 0) {
+    return 0;
+  }
+  long rank = (long)(op_stats->calls * fraction);
+  long seen = 0;
+  for (int i = 0; i < SFS_LATENCY_BUCKETS - 1; i++) {
+    seen += op_stats->histogram[i];
+    if (seen > rank) {
+      return 1L << i;
+    }
+  }
+  return 1L << (SFS_LATENCY_BUCKETS - 1);
+}
+
+void sfs_dump_stats() {
+  const char *names[SFS_OPS] = {"fopen",  "fclose", "fread",
+                                "fwrite", "remove", "sync"};
+  SfsStats copy;
+  sfs_get_stats(&copy);
+
+  printf("%-8s %10s %8s %12s %10s %10s %10s\n", "call", "calls", "errors",
+         "bytes", "avg us", "p50 <us", "p99 <us");
+  for (int op = 0; op < SFS_OPS; op++) {
+    SfsOpStats *op_stats = &copy.ops[op];
+    double avg = op_stats->calls > 0
+                     ? op_stats->total_ns / 1000.0 / op_stats->calls
+                     : 0;
+    printf("%-8s %10ld %8ld %12ld %10.1f %10ld %10ld\n", names[op],
+           op_stats->calls, op_stats->errors, op_stats->bytes, avg,
+           latency_percentile(op_stats, 0.5),
+           latency_percentile(op_stats, 0.99));
+  }
+  printf("allocator: %ld searches, %ld FBM words looked at, %ld at most\n",
+         copy.alloc_searches, copy.alloc_words, copy.alloc_longest);
+  printf("disk: %ld reads of %ld blocks (%ld bytes), %ld writes of %ld "
+         "blocks (%ld bytes)\n",
+         copy.disk.reads, copy.disk.blocks_read, copy.disk.bytes_read,
+         copy.disk.writes, copy.disk.blocks_written, copy.disk.bytes_written);
+  printf("device: %.3f ms busy, transfers took %.3f ms with queueing\n",
+         copy.disk.device_ns / 1e6, copy.disk.wait_ns / 1e6);
+  printf("cache: %ld hits, %ld misses, %ld evictions, %ld write-backs, %ld "
+         "bypassed, %ld prefetched, %ld prefetch hits\n",
+         copy.cache.hits, copy.cache.misses, copy.cache.evictions,
+         copy.cache.writebacks, copy.cache.bypassed, copy.cache.prefetched,
+         copy.cache.prefetch_hits);
+  printf("sync: %ld requests, %ld commits covering %ld of them\n",
+         copy.sync.requests, copy.sync.commits, copy.sync.batched);
+}
+
+// trace every API call to a new file at path, in place of any trace being
+// written. Its header records the geometry of the mounted file system.
+int sfs_trace_start(const char *path) {
+  pthread_rwlock_rdlock(&fs_lock);
+  TraceHeader header = {SFS_TRACE_MAGIC, SFS_TRACE_VERSION, block_size,
+                        max_block, max_file_no};
+  bool was_mounted = mounted;
+  pthread_rwlock_unlock(&fs_lock);
+  if (!was_mounted) {
+    return -1;
+  }
+  FILE *file = fopen(path, "wb");
+  if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1) {
+    if (file != NULL) {
+      fclose(file);
+    }
+    return -1;
+  }
+
+  sfs_trace_stop();
+  pthread_mutex_lock(&trace_lock);
+  trace_start = clock_ns();
+  __atomic_store_n(&trace_file, file, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+void sfs_trace_stop() {
+  pthread_mutex_lock(&trace_lock);
+  FILE *file = trace_file;
+  __atomic_store_n(&trace_file, NULL, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trace_lock);
+  if (file != NULL) {
+    fclose(file);
+  }
+}
+
+// takes effect at the next mksfs
+void sfs_set_cache_size(int blocks) {
+  if (blocks > 0) {
+    cache_blocks = blocks;
+  }
+}
+
+// FNV-1a hash of a file name
+unsigned int hash_name(const char *name) {
+  unsigned int hash = 2166136261u;
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+  return hash;
+}
+
+// find the root_dir index of the file with the given name, -1 if none
+int dir_lookup(const char *name) {
+  unsigned int slot = hash_name(name) & (dir_index_size - 1);
+  while (dir_index[slot] != DIR_SLOT_EMPTY) {
+    int i = dir_index[slot];
+    if (i != DIR_SLOT_DELETED && strcmp(root_dir[i].file_name, name) == 0) {
+      return i;
+    }
+    slot = (slot + 1) & (dir_index_size - 1);
+  }
+  return -1;
+}
+
+void dir_index_insert(int index) {
+  unsigned int slot =
+      hash_name(root_dir[index].file_name) & (dir_index_size - 1);
+  while (dir_index[slot] >= 0) {
+    slot = (slot + 1) & (dir_index_size - 1);
+  }
+  if (dir_index[slot] == DIR_SLOT_DELETED) {
+    dir_index_deleted--;
+  }
+  dir_index[slot] = index;
+}
+
+// build the index from scratch out of the used root_dir entries
+void dir_index_rebuild() {
+  for (int i = 0; i < dir_index_size; i++) {
+    dir_index[i] = DIR_SLOT_EMPTY;
+  }
+  dir_index_deleted = 0;
+  for (int i = 0; i < max_file_no; i++) {
+    if (root_dir[i].used) {
+      dir_index_insert(i);
+    }
+  }
+}
+
+void dir_index_remove(int index) {
+  unsigned int slot =
+      hash_name(root_dir[index].file_name) & (dir_index_size - 1);
+  while (dir_index[slot] != index) {
+    slot = (slot + 1) & (dir_index_size - 1);
+  }
+  dir_index[slot] = DIR_SLOT_DELETED;
+  // too many deleted slots make lookups of missing names scan far
+  if (++dir_index_deleted > dir_index_size / 4) {
+    dir_index_rebuild();
+  }
+}
+
+// for debugging 
+void printRootDir() {
+  printf("Root directory:\n");
+  for (int i = 0; i < max_file_no; i++) {
+    if (root_dir[i].used) {
+      printf("File name: %s, inode number: %d\n", root_dir[i].file_name,
+             root_dir[i].inode_num);
+    }
+  }
+}
+
+void write_superblock() {
+  char buffer[block_size];
+  memset(buffer, 0, block_size);
+  memcpy(buffer, &superblock, sizeof(superblock));
+  cache_write_blocks(0, 1, buffer);
+}
+
+bool valid_block_size(int size) {
+  return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE &&
+         (size & (size - 1)) == 0;
+}
+
+// blocks of a journal able to log every metadata block at once
+int journal_size(int size, int metadata_blocks) {
+  return journal_header_blocks(size, metadata_blocks) + metadata_blocks;
+}
+
+// derive the geometry of the file system from a superblock, -1 when it does
+// not describe a usable one. The globals are only set when apply is and the
+// geometry is usable, so a new superblock can be checked while another file
+// system is still mounted.
+int set_geometry(const Superblock *sb, bool apply) {
+  if (!valid_block_size(sb->block_size) || sb->fs_size <= 0 ||
+      sb->num_inodes < 2 || sb->inode_table_len <= 0 || sb->fbm_len <= 0) {
+    return -1;
+  }
+  int size = sb->block_size;
+  int ptrs = size / sizeof(int);
+  // file offsets are ints, so the triple indirect block is usually cut short
+  long map_blocks = NO_DIRECT_BLOCKS;
+  long span = 1;
+  for (int level = 0; level < MAP_LEVELS; level++) {
+    span *= ptrs;
+    map_blocks += span;
+  }
+  int file_blocks = map_blocks < INT_MAX / size ? map_blocks : INT_MAX / size;
+
+  // the root directory is a single file, and every table has to fit in the
+  // blocks reserved for it
+  long root_dir_size = (long)sb->num_inodes * sizeof(DirectoryEntry);
+  if (root_dir_size > (long)file_blocks * size ||
+      sb->num_inodes * (long)sizeof(Inode) >
+          (long)sb->inode_table_len * size ||
+      (long)sb->fs_size > 8L * sb->fbm_len * size) {
+    return -1;
+  }
+  int dir_blocks = (root_dir_size + size - 1) / size;
+  // leave room for the journal, the root directory and its index block
+  if (1L + sb->inode_table_len + sb->journal_len + dir_blocks + 1 +
+          sb->fbm_len >
+      sb->fs_size) {
+    return -1;
+  }
+  // a journal lies between the inode table and the free block map, and is
+  // always sized by journal_size
+  if (sb->journal_len != 0 &&
+      (sb->journal_len !=
+           journal_size(size, sb->inode_table_len + sb->fbm_len + dir_blocks) ||
+       sb->journal_start < 1 + sb->inode_table_len ||
+       sb->journal_start > sb->fs_size - sb->fbm_len - sb->journal_len)) {
+    return -1;
+  }
+  if (!apply) {
+    return 0;
+  }
+
+  block_size = size;
+  max_block = sb->fs_size;
+  fbm_blocks = sb->fbm_len;
+  fbm_words = (max_block + 63) / 64;
+  inode_table_blocks = sb->inode_table_len;
+  max_file_no = sb->num_inodes;
+  ptrs_per_block = ptrs;
+  max_file_blocks = file_blocks;
+  root_dir_blocks = dir_blocks;
+  journal_start = sb->journal_start;
+  journal_blocks = sb->journal_len;
+  dir_index_size = 1;
+  while (dir_index_size < 2 * max_file_no) {
+    dir_index_size *= 2;
+  }
+  return 0;
+}
+
+void free_tables() {
+  free(journal);
+  free(journal_buffers);
+  free(inode_table);
+  free(FBM);
+  free(prealloc_map);
+  free(freed_map);
+  free(root_dir);
+  free(dir_index);
+  free(inode_table_dirty);
+  free(FBM_dirty);
+  free(root_dir_dirty);
+  for (int i = 0; FDT != NULL && i < max_file_no; i++) {
+    pthread_mutex_destroy(&FDT[i].lock);
+  }
+  for (int i = 0; inode_locks != NULL && i < max_file_no; i++) {
+    pthread_rwlock_destroy(&inode_locks[i]);
+  }
+  free(FDT);
+  free(inode_locks);
+  for (int level = 0; level < MAP_LEVELS; level++) {
+    free(map_path[level].entries);
+    map_path[level].entries = NULL;
+  }
+  FDT = NULL;
+  inode_locks = NULL;
+  journal = NULL;
+  journal_buffers = NULL;
+  inode_table = NULL;
+  FBM = NULL;
+  prealloc_map = NULL;
+  freed_map = NULL;
+  freed_count = 0;
+  root_dir = NULL;
+  dir_index = NULL;
+  inode_table_dirty = NULL;
+  FBM_dirty = NULL;
+  root_dir_dirty = NULL;
+}
 
-Superblock superblock;
-File FDT[MAX_FILE_NO] = {0};
-Inode inode_table[MAX_FILE_NO] = {0};
-int FBM[MAX_BLOCK] = {0};
-DirectoryEntry root_dir[MAX_FILE_NO] = {0};
-int next_file_index = 0;  // for sfs_getnextfilename
+// allocate the zero filled in-memory tables for the current geometry
+int alloc_tables() {
+  FDT = (File *)calloc(max_file_no, sizeof(File));
+  inode_table = (Inode *)calloc(inode_table_blocks, block_size);
+  FBM = (uint64_t *)calloc(fbm_blocks, block_size);
+  prealloc_map = (uint64_t *)calloc(fbm_blocks, block_size);
+  freed_map = (uint64_t *)calloc(fbm_blocks, block_size);
+  root_dir = (DirectoryEntry *)calloc(root_dir_blocks, block_size);
+  dir_index = (int *)malloc(dir_index_size * sizeof(int));
+  inode_table_dirty = (bool *)calloc(inode_table_blocks, sizeof(bool));
+  FBM_dirty = (bool *)calloc(fbm_blocks, sizeof(bool));
+  root_dir_dirty = (bool *)calloc(root_dir_blocks, sizeof(bool));
+  int metadata_blocks = inode_table_blocks + fbm_blocks + root_dir_blocks;
+  journal_header_max = journal_header_blocks(block_size, metadata_blocks);
+  journal = (JournalHeader *)malloc((size_t)journal_header_max * block_size);
+  journal_buffers = (void **)malloc((journal_header_max + metadata_blocks) *
+                                    sizeof(void *));
+  inode_locks =
+      (pthread_rwlock_t *)calloc(max_file_no, sizeof(pthread_rwlock_t));
+  for (int i = 0; FDT != NULL && i < max_file_no; i++) {
+    pthread_mutex_init(&FDT[i].lock, NULL);
+  }
+  for (int i = 0; inode_locks != NULL && i < max_file_no; i++) {
+    pthread_rwlock_init(&inode_locks[i], NULL);
+  }
+  bool failed = FDT == NULL || inode_table == NULL || FBM == NULL ||
+                prealloc_map == NULL || freed_map == NULL || root_dir == NULL ||
+                dir_index == NULL || inode_table_dirty == NULL ||
+                FBM_dirty == NULL || root_dir_dirty == NULL ||
+                inode_locks == NULL || journal == NULL ||
+                journal_buffers == NULL;
+  for (int level = 0; level < MAP_LEVELS; level++) {
+    map_path[level].block_num = -1;
+    map_path[level].dirty = false;
+    map_path[level].entries = (int *)malloc(block_size);
+    failed |= map_path[level].entries == NULL;
+  }
+  if (failed) {
+    free_tables();
+    return -1;
+  }
+  return 0;
+}
 
-int min(int x, int y) { return x < y ? x : y; }
+// the superblock, the inode table and the free block map blocks at the end
+// of the disk are never handed out by the allocator, and neither are the
+// bits of the last bitmap word past the end of the disk
+void set_reserved_blocks_used() {
+  set_block_used(0);
+  for (int i = 0; i < inode_table_blocks; i++) {
+    set_block_used(i + 1);
+  }
+  for (int i = 0; i < journal_blocks; i++) {
+    set_block_used(journal_start + i);
+  }
+  for (int i = 1; i <= fbm_blocks; i++) {
+    set_block_used(max_block - i);
+  }
+  for (int i = max_block; i < fbm_words * 64; i++) {
+    set_block_used(i);
+  }
+}
 
-// find the free block in FBM and allocate
-int allocate_free_block() {
-  for (int i = 0; i < MAX_BLOCK; i++) {
-    if (FBM[i] == 0) {
-      FBM[i] = 1;
-      return i;
+// images written before the free block map became a bitmap stored one int
+// per block, and only the first four blocks worth of it, so the map is
+// rebuilt from the blocks referenced by the inode table instead
+void convert_legacy_image() {
+  // those images also left the root inode size at 0, and only ever wrote the
+  // first block of the root directory (when a file was removed)
+  Inode *root_inode = &inode_table[superblock.root_inode];
+  if (root_inode->size == 0 && root_inode->direct[0] != -1) {
+    cache_read_blocks(root_inode->direct[0], 1, root_dir);
+    memset(root_dir_dirty, true, root_dir_blocks);
+  }
+
+  memset(FBM, 0, (size_t)fbm_blocks * block_size);
+  fbm_hint = 0;
+  set_reserved_blocks_used();
+  for (int i = 0; i < max_file_no; i++) {
+    InodeV2 *inode = (InodeV2 *)&inode_table[i];
+    if (inode->size == -1) {
+      continue;
+    }
+    for (int j = 0; j < 12; j++) {
+      if (inode->direct[j] != -1) {
+        set_block_used(inode->direct[j]);
+      }
+    }
+    if (inode->indirect != -1) {
+      int index_block[ptrs_per_block];
+      cache_read_blocks(inode->indirect, 1, (char *)&index_block);
+      for (int j = 0; j < ptrs_per_block; j++) {
+        if (index_block[j] != -1) {
+          set_block_used(index_block[j]);
+        }
+      }
+      set_block_used(inode->indirect);
     }
   }
-  return -1;
 }
 
-int find_no_file_blocks(int size) {
-  int no_blocks = size / BLOCK_SIZE;
-  if (size % BLOCK_SIZE != 0) {
-    no_blocks++;
+// images before version 3 map blocks 10 and 11 of a file directly and the
+// following ones through the single indirect block, so every block map that
+// goes past block 9 is rebuilt in the current layout around the same blocks
+void convert_block_maps() {
+  for (int i = 0; i < max_file_no; i++) {
+    InodeV2 old;
+    memcpy(&old, &inode_table[i], sizeof(old));
+    if (old.size == -1 ||
+        (old.direct[10] == -1 && old.direct[11] == -1 && old.indirect == -1)) {
+      continue;  // the two layouts are the same
+    }
+
+    int old_index[ptrs_per_block];
+    if (old.indirect != -1) {
+      cache_read_blocks(old.indirect, 1, (char *)&old_index);
+      free_block(old.indirect);
+    }
+    Inode *inode = &inode_table[i];
+    for (int level = 0; level < MAP_LEVELS; level++) {
+      inode->indirect[level] = -1;
+    }
+    for (int lblk = NO_DIRECT_BLOCKS; lblk < 12 + ptrs_per_block; lblk++) {
+      int block_num = -1;
+      if (lblk < 12) {
+        block_num = old.direct[lblk];
+      } else if (old.indirect != -1) {
+        block_num = old_index[lblk - 12];
+      }
+      if (block_num == -1) {
+        continue;
+      }
+      int leaf;
+      int *entry = map_entry(inode, lblk, true, &leaf);
+      if (entry == NULL) {
+        break;
+      }
+      *entry = block_num;
+      map_path[leaf].dirty = true;
+    }
+    flush_map_path();
+    mark_inode_dirty(i);
   }
-  return no_blocks;
 }
 
-void fill_last_block(int block_num, char *write_buffer, int offset,
-                     int remaining, char *writing_contents) {
-  char *buffer = (char *)malloc(BLOCK_SIZE);
-  read_blocks(block_num, 1, buffer);
-  memcpy(write_buffer, buffer, offset);
-  memcpy(write_buffer + offset, writing_contents, remaining);
-  free(buffer);
+// copy the blocks of the transaction last committed to the journal to their
+// place, unless a crash cut it short. Nothing else is on the disk cache yet.
+int replay_journal() {
+  if (read_blocks(journal_start, 1, journal) < 0) {
+    return -1;
+  }
+  int count = journal->count;
+  if (journal->magic != JOURNAL_MAGIC || count <= 0 ||
+      count > journal_blocks) {
+    return 0;
+  }
+  int header_blocks = journal_header_blocks(block_size, count);
+  if (header_blocks + count > journal_blocks) {
+    return 0;
+  }
+  char *logged = (char *)malloc((size_t)count * block_size);
+  if (logged == NULL ||
+      (header_blocks > 1 &&
+       read_blocks(journal_start + 1, header_blocks - 1,
+                   (char *)journal + block_size) < 0) ||
+      read_blocks(journal_start + header_blocks, count, logged) < 0) {
+    free(logged);
+    return -1;
+  }
+  void **buffers = journal_buffers + journal_header_max - header_blocks;
+  for (int i = 0; i < header_blocks; i++) {
+    buffers[i] = (char *)journal + (size_t)i * block_size;
+  }
+  for (int i = 0; i < count; i++) {
+    buffers[header_blocks + i] = logged + (size_t)i * block_size;
+  }
+  uint32_t checksum = journal->checksum;
+  journal->checksum = 0;
+  if (journal_checksum(buffers, header_blocks + count) == checksum) {
+    for (int i = 0; i < count; i++) {
+      int block_num = journal->blocks[i];
+      if (block_num > 0 && block_num < max_block) {
+        write_blocks(block_num, 1, buffers[header_blocks + i]);
+      }
+    }
+    sync_disk();
+  }
+  free(logged);
+  memset(journal, 0, block_size);
+  return write_blocks(journal_start, 1, journal) < 0 ? -1 : 0;
 }
 
-// for debugging 
-void printRootDir() {
-  printf("Root directory:\n");
-  for (int i = 0; i < MAX_FILE_NO; i++) {
-    if (root_dir[i].used) {
-      printf("File name: %s, inode number: %d\n", root_dir[i].file_name,
-             root_dir[i].inode_num);
+// give an image from before version 4 a journal, when it has a free run of
+// blocks long enough for one
+void add_journal() {
+  int wanted = journal_size(
+      block_size, inode_table_blocks + fbm_blocks + root_dir_blocks);
+  int got = 0;
+  int start = allocate_free_run(1 + inode_table_blocks, wanted, &got, false);
+  if (got < wanted) {
+    for (int i = 0; i < got; i++) {
+      free_block(start + i);
     }
+    start = 0;
+    wanted = 0;
   }
+  superblock.journal_start = journal_start = start;
+  superblock.journal_len = journal_blocks = wanted;
 }
 
-void mksfs(int fresh) {
+// format a fresh image with the given geometry (the default one when it is
+// NULL), or mount the existing image with the geometry its superblock records
+int mount_fs(int fresh, const SfsGeometry *geometry) {
+  // the new superblock is checked before anything is unmounted, so a bad
+  // geometry or image leaves the mounted file system as it was
+  Superblock sb;
   if (fresh) {
-    init_fresh_disk("my_sfs", BLOCK_SIZE, MAX_BLOCK);
+    SfsGeometry defaults = {DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS,
+                            DEFAULT_NUM_INODES};
+    if (geometry == NULL) {
+      geometry = &defaults;
+    }
+    if (!valid_block_size(geometry->block_size)) {
+      printf("invalid file system geometry\n");
+      return -1;
+    }
+    long bits_per_block = 8L * geometry->block_size;
     // create superblock
-    superblock.magic = 0xACBD0005;
-    superblock.block_size = BLOCK_SIZE;
-    superblock.fs_size = MAX_BLOCK;
-    superblock.inode_table_len = INODE_TABLE_SIZE;
-    superblock.root_inode = 0;
-    // write superblock to disk
-    char *buffer = (char *)&superblock;
-    write_blocks(0, 1, buffer);
-
-    // initialize free byte map, first block is used for superblock
-    FBM[0] = 1;
-    // allocate 4 free byte map blocks at the end of the disk
-    for (int i = 1; i <= NO_FBM_BLOCKS; i++) {
-      FBM[MAX_BLOCK - i] = 1;
-    }
-    // allocate 6 blocks for inode table after superblock on disk
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-      FBM[i + 1] = 1;
-    }
-    // allocate 1 block for root directory
-    FBM[DATA_BLOCK_START] = 1;
-    // write free byte map to disk
-    buffer = (char *)&FBM;
-    write_blocks(MAX_BLOCK - NO_FBM_BLOCKS, NO_FBM_BLOCKS, buffer);
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = SFS_MAGIC;
+    sb.block_size = geometry->block_size;
+    sb.fs_size = geometry->num_blocks;
+    sb.inode_table_len =
+        ((long)geometry->num_inodes * sizeof(Inode) + geometry->block_size -
+         1) / geometry->block_size;
+    sb.root_inode = 0;
+    sb.version = SFS_VERSION;
+    sb.num_inodes = geometry->num_inodes;
+    sb.fbm_len = (geometry->num_blocks + bits_per_block - 1) / bits_per_block;
+    if (set_geometry(&sb, false) < 0) {
+      printf("invalid file system geometry\n");
+      return -1;
+    }
+    // a fresh image gets its journal right after the inode table, when the
+    // disk has room for it
+    int dir_blocks =
+        ((long)sb.num_inodes * sizeof(DirectoryEntry) + sb.block_size - 1) /
+        sb.block_size;
+    int size = journal_size(sb.block_size,
+                            sb.inode_table_len + sb.fbm_len + dir_blocks);
+    int used = 1 + sb.inode_table_len + size + dir_blocks + 1 + sb.fbm_len;
+    if (used <= sb.fs_size) {
+      sb.journal_start = 1 + sb.inode_table_len;
+      sb.journal_len = size;
+    }
+  } else if (mounted) {
+    // the image is the one mounted, whose superblock is already in memory
+    sb = superblock;
+  } else {
+    // the superblock records the geometry, so it is read on its own first
+    if (init_disk("my_sfs", sizeof(Superblock), 1) < 0) {
+      return -1;
+    }
+    read_blocks(0, 1, &sb);
+    close_disk();
+    if (sb.magic != SFS_MAGIC && sb.magic != LEGACY_MAGIC) {
+      printf("not a file system image\n");
+      return -1;
+    }
+    if (sb.magic == LEGACY_MAGIC) {
+      sb.version = 0;  // not recorded by those images
+    }
+    if (sb.version > SFS_VERSION) {
+      printf("file system image of a newer version (%d)\n", sb.version);
+      return -1;
+    }
+    if (sb.version < 2) {
+      sb.num_inodes = DEFAULT_NUM_INODES;
+      sb.fbm_len = V1_FBM_BLOCKS;
+    }
+    if (sb.version < 4) {
+      sb.journal_start = 0;
+      sb.journal_len = 0;
+    }
+  }
+  if (set_geometry(&sb, false) < 0) {
+    printf("invalid file system geometry\n");
+    return -1;
+  }
+
+  // remounting flushes and closes the previously mounted disk first
+  if (mounted) {
+    for (int i = 0; i < max_file_no; i++) {
+      if (FDT[i].inode_num != -1) {
+        flush_tail(i);
+        drop_tail(i);
+        release_prealloc(i);
+        drop_block_map(i);
+      }
+    }
+    sync_fs(true);
+    cache_destroy();
+    close_disk();
+    free_tables();
+    mounted = false;
+  }
+  superblock = sb;
+  set_geometry(&superblock, true);
+
+  int opened = fresh ? init_fresh_disk("my_sfs", block_size, max_block)
+                     : init_disk("my_sfs", block_size, max_block);
+  if (opened < 0) {
+    return -1;
+  }
+  if (cache_init(cache_blocks, block_size) < 0 || alloc_tables() < 0) {
+    cache_destroy();
+    close_disk();
+    return -1;
+  }
+
+  if (fresh) {
+    write_superblock();
+
+    // initialize free block map, first block is used for superblock
+    fbm_hint = 0;
+    set_reserved_blocks_used();
 
     // initialize inode table
-    for (int i = 0; i < MAX_FILE_NO; i++) {
+    for (int i = 0; i < max_file_no; i++) {
       inode_table[i].size = -1;
-      for (int j = 0; j < 12; j++) {
+      for (int j = 0; j < NO_DIRECT_BLOCKS; j++) {
         inode_table[i].direct[j] = -1;
       }
-      inode_table[i].indirect = -1;
-    }
-
-    // initialize inode table for root directory
-    inode_table[0].size = 0;
-    for (int i = 0; i < 12; i++) {
-      inode_table[0].direct[i] = -1;
+      for (int j = 0; j < MAP_LEVELS; j++) {
+        inode_table[i].indirect[j] = -1;
+      }
     }
-    inode_table[0].indirect = -1;
-    // point the root inode to the root directory
-    inode_table[0].direct[0] = DATA_BLOCK_START;
-    buffer = (char *)&inode_table;
-    write_blocks(1, INODE_TABLE_SIZE, buffer);
 
-    // write an empty root directory to disk
-    buffer = (char *)&root_dir;
-    write_blocks(DATA_BLOCK_START, 1, buffer);
+    // allocate the root directory blocks at the start of the data region
+    int blocks[root_dir_blocks];
+    inode_table[0].size = max_file_no * sizeof(DirectoryEntry);
+    allocate_file_blocks(-1, &inode_table[0], 0, root_dir_blocks, blocks);
 
-    // initialize the root directory array
-    for (int i = 0; i < MAX_FILE_NO; i++) {
-      root_dir[i].used = false;
-    }
+    // everything is written by the first flush below
+    memset(FBM_dirty, true, fbm_blocks);
+    memset(inode_table_dirty, true, inode_table_blocks);
+    memset(root_dir_dirty, true, root_dir_blocks);
 
   } else {
-    init_disk("my_sfs", BLOCK_SIZE, MAX_BLOCK);
-    // read superblock from disk to memory and store it in superblock
-    char *buffer = (char *)&superblock;
-    read_blocks(0, 1, buffer);
-    int root_inode = superblock.root_inode;
+    // finish the last sync a crash interrupted before reading any metadata
+    if (journal_blocks > 0 && replay_journal() < 0) {
+      cache_destroy();
+      close_disk();
+      free_tables();
+      return -1;
+    }
 
-    // read free byte map from disk to memory and store it in FBM
-    buffer = (char *)&FBM;
-    read_blocks(MAX_BLOCK - NO_FBM_BLOCKS, NO_FBM_BLOCKS, buffer);
+    // read free block map from disk to memory and store it in FBM
+    cache_read_blocks(max_block - fbm_blocks, fbm_blocks, FBM);
+    fbm_hint = 0;
 
     // read inode table from disk to memory and store it in inode_table
-    buffer = (char *)&inode_table;
-    read_blocks(1, INODE_TABLE_SIZE, buffer);
+    cache_read_blocks(1, inode_table_blocks, inode_table);
+
+    // older images are upgraded in place
+    if (superblock.magic == LEGACY_MAGIC) {
+      convert_legacy_image();
+    }
+    if (superblock.version < 3) {
+      convert_block_maps();
+    }
+    if (superblock.version < 4) {
+      add_journal();
+    }
+    if (superblock.version < SFS_VERSION) {
+      superblock.magic = SFS_MAGIC;
+      superblock.version = SFS_VERSION;
+      write_superblock();
+    }
 
-    // find the root directory inode in the inode table
-    Inode root_dir_inode = inode_table[root_inode];
-    // use it's size to determine how many blocks it occupies
-    int root_dir_blocks = find_no_file_blocks(root_dir_inode.size);
+    // find the root directory inode in the inode table, and use its size to
+    // determine how many blocks it occupies
+    Inode root_dir_inode = inode_table[superblock.root_inode];
+    int root_dir_size =
+        min(root_dir_inode.size, max_file_no * sizeof(DirectoryEntry));
 
     // read the root directory from disk to memory and store it in root_dir
-    char root_dir_buffer[root_dir_blocks * BLOCK_SIZE];
-    if (root_dir_blocks <= 12) {
-      for (int i = 0; i < root_dir_blocks; i++) {
-        read_blocks(root_dir_inode.direct[i], 1,
-                    root_dir_buffer + i * BLOCK_SIZE);
-      }
-    } else {
-      // read the first 12 blocks
-      for (int i = 0; i < 12; i++) {
-        read_blocks(root_dir_inode.direct[i], 1,
-                    root_dir_buffer + i * BLOCK_SIZE);
-      }
-      // read the index block
-      int indirect_block_buffer[BLOCK_SIZE / sizeof(int)];
-      read_blocks(root_dir_inode.indirect, 1, (char *)&indirect_block_buffer);
-      // read the data blocks pointed by the index block
-      for (int i = 12; i < root_dir_blocks; i++) {
-        read_blocks(indirect_block_buffer[i - 12], 1,
-                    root_dir_buffer + i * BLOCK_SIZE);
-      }
+    if (root_dir_size > 0) {
+      int no_blocks = find_no_file_blocks(root_dir_size);
+      int blocks[no_blocks];
+      map_file_blocks(-1, &root_dir_inode, 0, no_blocks, blocks);
+      transfer_file_blocks(blocks, no_blocks, 0, root_dir_size,
+                           (char *)root_dir, false, 0);
     }
-
-    // read the root directory blocks into root_dir
-    memcpy(&root_dir, root_dir_buffer, root_dir_blocks * BLOCK_SIZE);
   }
+  mounted = true;
+  dir_index_rebuild();
 
   // initialize file descriptor table
-  for (int i = 0; i < MAX_FILE_NO; i++) {
+  for (int i = 0; i < max_file_no; i++) {
     FDT[i].inode_num = -1;
     FDT[i].offset = 0;
+    FDT[i].prealloc_len = 0;
+    FDT[i].block_map = NULL;
+    FDT[i].block_map_len = 0;
+    FDT[i].ra_last = -1;
+    FDT[i].ra_window = 0;
+    FDT[i].tail_buffer = NULL;
+    FDT[i].tail_block = -1;
+    FDT[i].removed = false;
+  }
+
+  // write out a freshly formatted or converted image right away
+  sync_fs(true);
+  return 0;
+}
+
+int mksfs_geometry(int fresh, const SfsGeometry *geometry) {
+  pthread_rwlock_wrlock(&fs_lock);
+  int status = mount_fs(fresh, geometry);
+  pthread_rwlock_unlock(&fs_lock);
+  // SFS_TRACE in the environment names a trace to start with the mount
+  char *trace = getenv("SFS_TRACE");
+  if (status == 0 && trace != NULL && !tracing()) {
+    sfs_trace_start(trace);
   }
+  return status;
 }
 
-int sfs_fopen(char *name) {
-  if (strlen(name) > MAXFILENAME) {
-    return -1;
+void mksfs(int fresh) { mksfs_geometry(fresh, NULL); }
+
+// lock the FDT entry of a file, false (leaving it unlocked) when the file is
+// not open
+bool lock_file(int fileID) {
+  if (!mounted || fileID < 0 || fileID >= max_file_no) {
+    return false;
   }
+  pthread_mutex_lock(&FDT[fileID].lock);
+  if (FDT[fileID].inode_num != -1) {
+    return true;
+  }
+  pthread_mutex_unlock(&FDT[fileID].lock);
+  return false;
+}
+
+// lock an open file for an operation on it: fs_lock shared, its FDT entry,
+// then its inode, exclusively or shared. A shared lock is preceded by writing
+// out the tail buffer, which changes the inode. Returns the inode lock, or
+// NULL (with nothing locked) when the file is not open or was removed.
+pthread_rwlock_t *lock_open_file(int fileID, bool exclusive) {
+  pthread_rwlock_rdlock(&fs_lock);
+  if (!lock_file(fileID)) {
+    pthread_rwlock_unlock(&fs_lock);
+    return NULL;
+  }
+  if (FDT[fileID].removed) {
+    pthread_mutex_unlock(&FDT[fileID].lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return NULL;
+  }
+  pthread_rwlock_t *inode_lock = &inode_locks[FDT[fileID].inode_num];
+  if (exclusive) {
+    pthread_rwlock_wrlock(inode_lock);
+    return inode_lock;
+  }
+  if (FDT[fileID].tail_block != -1) {
+    pthread_rwlock_wrlock(inode_lock);
+    flush_tail(fileID);
+    pthread_rwlock_unlock(inode_lock);
+  }
+  pthread_rwlock_rdlock(inode_lock);
+  return inode_lock;
+}
 
-  // check if the file already exists by searching the root directory
+void unlock_open_file(int fileID, pthread_rwlock_t *inode_lock) {
+  pthread_rwlock_unlock(inode_lock);
+  pthread_mutex_unlock(&FDT[fileID].lock);
+  pthread_rwlock_unlock(&fs_lock);
+}
+
+// set up a free FDT entry for the given inode, the caller holds fdt_lock
+void open_entry(int fdt_index, int inode_num, int offset) {
+  pthread_mutex_lock(&FDT[fdt_index].lock);
+  FDT[fdt_index].inode_num = inode_num;
+  FDT[fdt_index].offset = offset;
+  FDT[fdt_index].prealloc_len = 0;
+  FDT[fdt_index].ra_last = -1;
+  FDT[fdt_index].ra_window = 0;
+  FDT[fdt_index].removed = false;
+  pthread_mutex_unlock(&FDT[fdt_index].lock);
+}
+
+// the caller holds dir_lock exclusively and fdt_lock
+int open_file(char *name) {
+  if (!mounted) {
+    return -1;
+  }
+  // check if the file already exists by looking it up in the root directory
   int file_inode_num = -1;
-  for (int i = 0; i < MAX_FILE_NO; i++) {
-    if (root_dir[i].used && strcmp(root_dir[i].file_name, name) == 0) {
-      // the file already exists
-      file_inode_num = root_dir[i].inode_num;
-      break;
-    }
+  int dir_entry = dir_lookup(name);
+  if (dir_entry != -1) {
+    file_inode_num = root_dir[dir_entry].inode_num;
   }
 
   // file already exists
   if (file_inode_num != -1) {
     // check if the file is already open
-    for (int i = 0; i < MAX_FILE_NO; i++) {
-      if (FDT[i].inode_num == file_inode_num) {
+    for (int i = 0; i < max_file_no; i++) {
+      if (FDT[i].inode_num == file_inode_num && !FDT[i].removed) {
         return i;
       }
     }
 
     // find the file inode in the inode table
+    pthread_rwlock_rdlock(&inode_locks[file_inode_num]);
     Inode file_inode = inode_table[file_inode_num];
+    pthread_rwlock_unlock(&inode_locks[file_inode_num]);
 
     // find a free file descriptor table entry
     int fdt_index = -1;
-    for (int i = 0; i < MAX_FILE_NO; i++) {
+    for (int i = 0; i < max_file_no; i++) {
       if (FDT[i].inode_num == -1) {
         fdt_index = i;
         break;
@@ -252,14 +2085,13 @@ int sfs_fopen(char *name) {
     }
 
     // set the file descriptor table entry
-    FDT[fdt_index].inode_num = file_inode_num;
-    FDT[fdt_index].offset = file_inode.size;
+    open_entry(fdt_index, file_inode_num, file_inode.size);
     return fdt_index;
   }
 
   // the file does not exist
   int fdt_index = -1;
-  for (int i = 0; i < MAX_FILE_NO; i++) {
+  for (int i = 0; i < max_file_no; i++) {
     if (FDT[i].inode_num == -1) {
       fdt_index = i;
       break;
@@ -268,12 +2100,16 @@ int sfs_fopen(char *name) {
   if (fdt_index == -1) {
     return -1;
   }
-  // find the first available inode in the inode table
+  // find the first available inode in the inode table. Inodes locked for
+  // writing are being written and so in use, only removing a file frees one
+  // and that needs dir_lock.
   file_inode_num = -1;
-  for (int i = 0; i < MAX_FILE_NO; i++) {
-    if (inode_table[i].size == -1) {
-      file_inode_num = i;
-      break;
+  for (int i = 0; i < max_file_no && file_inode_num == -1; i++) {
+    if (pthread_rwlock_tryrdlock(&inode_locks[i]) == 0) {
+      if (inode_table[i].size == -1) {
+        file_inode_num = i;
+      }
+      pthread_rwlock_unlock(&inode_locks[i]);
     }
   }
   if (file_inode_num == -1) {
@@ -281,16 +2117,16 @@ int sfs_fopen(char *name) {
   }
 
   // set the file descriptor table entry
-  FDT[fdt_index].inode_num = file_inode_num;
-  FDT[fdt_index].offset = 0;
+  open_entry(fdt_index, file_inode_num, 0);
 
   // set the inode table entry
+  // data blocks are only allocated by the first write
   inode_table[file_inode_num].size = 0;
-  inode_table[file_inode_num].direct[0] = allocate_free_block();
+  mark_inode_dirty(file_inode_num);
 
   // set the root directory entry by finding the first available entry
   int root_dir_index = -1;
-  for (int i = 0; i < MAX_FILE_NO; i++) {
+  for (int i = 0; i < max_file_no; i++) {
     if (!root_dir[i].used) {
       root_dir_index = i;
       break;
@@ -304,276 +2140,313 @@ int sfs_fopen(char *name) {
   root_dir[root_dir_index].inode_num = file_inode_num;
   strcpy(root_dir[root_dir_index].file_name, name);
   root_dir[root_dir_index].used = 1;
+  mark_root_dir_dirty(root_dir_index);
+  dir_index_insert(root_dir_index);
   return fdt_index;
 }
 
+int sfs_fopen(char *name) {
+  Call call = begin_call(TRACE_FOPEN, -1, name, -1, -1);
+  if (strlen(name) > MAXFILENAME) {
+    return end_call(&call, -1);
+  }
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_wrlock(&dir_lock);
+  pthread_mutex_lock(&fdt_lock);
+  int fileID = open_file(name);
+  pthread_mutex_unlock(&fdt_lock);
+  pthread_rwlock_unlock(&dir_lock);
+  pthread_rwlock_unlock(&fs_lock);
+  return end_call(&call, fileID);
+}
+
 int sfs_fclose(int fileID) {
+  Call call = begin_call(TRACE_FCLOSE, fileID, NULL, -1, -1);
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_mutex_lock(&fdt_lock);
   // check if the file is open
-  if (FDT[fileID].inode_num == -1) {
-    return -1;
+  if (!lock_file(fileID)) {
+    pthread_mutex_unlock(&fdt_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return end_call(&call, -1);
   }
 
+  int inode_num = FDT[fileID].inode_num;
+  pthread_rwlock_wrlock(&inode_locks[inode_num]);
+  flush_tail(fileID);
+  pthread_rwlock_unlock(&inode_locks[inode_num]);
+  drop_tail(fileID);
+  pthread_mutex_lock(&alloc_lock);
+  release_prealloc(fileID);
+  pthread_mutex_unlock(&alloc_lock);
+  drop_block_map(fileID);
   FDT[fileID].inode_num = -1;
   FDT[fileID].offset = 0;
-  return 0;
+  pthread_mutex_unlock(&FDT[fileID].lock);
+  pthread_mutex_unlock(&fdt_lock);
+  pthread_rwlock_unlock(&fs_lock);
+
+  // closing a file is a flush point for the deferred metadata writes, and
+  // there are none when nothing changed since the last sync
+  if (changed_since_sync()) {
+    group_sync();
+  }
+  return end_call(&call, 0);
 }
 
-int sfs_fwrite(int fileID, char *buf, int length) {
-  // check if the file is open
-  if (FDT[fileID].inode_num == -1) {
-    return -1;
+// a journal commit covers the whole file system, so syncing one file is a
+// sync that fails when the file is not open
+int sfs_fsync(int fileID) {
+  Call call = begin_call(TRACE_FSYNC, fileID, NULL, -1, -1);
+  pthread_rwlock_rdlock(&fs_lock);
+  bool open = lock_file(fileID);
+  if (open) {
+    open = !FDT[fileID].removed;
+    pthread_mutex_unlock(&FDT[fileID].lock);
   }
+  pthread_rwlock_unlock(&fs_lock);
+  return end_call(&call, open ? group_sync() : -1);
+}
+
+// write length bytes at offset into the file open as fileID, the caller
+// holds the FDT entry and the inode lock exclusively
+int write_file(int fileID, const char *buf, int length, int offset) {
+  __atomic_add_fetch(&dirty_generation, 1, __ATOMIC_RELAXED);
+  // small appends are gathered in the tail buffer, anything else writes
+  // the buffer out first
+  if (buffer_append(fileID, buf, length, offset)) {
+    return length;
+  }
+  flush_tail(fileID);
 
   // get the file inode from the inode table
   int file_inode_num = FDT[fileID].inode_num;
   Inode file_inode = inode_table[file_inode_num];
 
-  // calculate the current block and offset within the block
-  int current_block = FDT[fileID].offset / BLOCK_SIZE;
-  int offset_within_block = FDT[fileID].offset % BLOCK_SIZE;
-
-  // calculate the remaining space in the current block
-  int remaining_space_in_block = BLOCK_SIZE - offset_within_block;
-
-  // temp variables to record bytes have been written and buf left to write
-  int bytes_written = 0;
-  char *current_buffer = buf;
-
-  while (bytes_written < length) {
-    // check if the current block is within the direct blocks of the inode
-    if (current_block < 12) {
-      // If the current block is not allocated, allocate a new block
-      if (file_inode.direct[current_block] == -1) {
-        file_inode.direct[current_block] = allocate_free_block();
-        if (file_inode.direct[current_block] == -1) {
-          printf("error for direct block allocation\n");
-          return bytes_written;
-        }
-      }
-
-      // calculate the amount of data to write in the current block
-      int write_size = min(remaining_space_in_block, length - bytes_written);
-
-      if (bytes_written == 0 && write_size <= remaining_space_in_block) {
-        // fill the remaining space in current block
-        char write_buffer[BLOCK_SIZE];
-        fill_last_block(file_inode.direct[current_block], write_buffer,
-                        offset_within_block, write_size, current_buffer);
-        write_blocks(file_inode.direct[current_block], 1, write_buffer);
-      } else {
-        // write the data to the current block
-        char write_buffer[BLOCK_SIZE];
-        memcpy(write_buffer, current_buffer, write_size);
-        write_blocks(file_inode.direct[current_block], 1, write_buffer);
-      }
-
-      // update file pointer and counters
-      FDT[fileID].offset += write_size;
-      bytes_written += write_size;
-      current_block++;
-      remaining_space_in_block = BLOCK_SIZE;
-      current_buffer += write_size;
-      // need to update the offset because we may fill the remaining space in
-      // the indirect block later
-      offset_within_block = FDT[fileID].offset % BLOCK_SIZE;
-    } else {
-      // exceed the max file size
-      if (current_block >= 12 + BLOCK_SIZE / sizeof(int)) {
-        printf("you are trying to write beyond the limit of file size\n");
-        return bytes_written;
-      }
-      // if the current block is in the indirect block
-      if (file_inode.indirect == -1) {
-        // if the indirect block is not allocated, allocate a new block
-        file_inode.indirect = allocate_free_block();
-        if (file_inode.indirect == -1) {
-          printf("error for index block allocation\n");
-          return bytes_written;
-        }
-
-        // initialize the indirect block with -1 (unallocated)
-        int indirect_block_buffer[BLOCK_SIZE / sizeof(int)];
-        for (int i = 0; i < BLOCK_SIZE / sizeof(int); i++) {
-          indirect_block_buffer[i] = -1;
-        }
-        // write the initialized indirect block to disk
-        write_blocks(file_inode.indirect, 1, (char *)&indirect_block_buffer);
-      }
-
-      // read the indirect block into memory
-      int index_block[BLOCK_SIZE / sizeof(int)];
-      read_blocks(file_inode.indirect, 1, (char *)&index_block);
-
-      // if the current block is not allocated, allocate a new block
-      if (index_block[current_block - 12] == -1) {
-        index_block[current_block - 12] = allocate_free_block();
-        if (index_block[current_block - 12] == -1) {
-          printf("error for indirect data block allocation\n");
-          return bytes_written;
-        }
-        // write the updated index block to disk
-        write_blocks(file_inode.indirect, 1, (char *)&index_block);
-      }
-
-      // calculate the amount of data to write in the current block
-      int write_size = min(remaining_space_in_block, length - bytes_written);
+  // calculate the logical blocks covered by the write
+  int first_block = offset / block_size;
+  int no_blocks = find_no_file_blocks(offset % block_size + length);
+  if (first_block + no_blocks > max_file_blocks) {
+    printf("you are trying to write beyond the limit of file size\n");
+    no_blocks = max_file_blocks - first_block;
+  }
+  if (length <= 0 || no_blocks <= 0) {
+    return 0;
+  }
 
-      if (bytes_written == 0 && write_size <= remaining_space_in_block) {
-        // fill the remaining space in current block
-        char write_buffer[BLOCK_SIZE];
-        fill_last_block(index_block[current_block - 12], write_buffer,
-                        offset_within_block, write_size, current_buffer);
-        write_blocks(index_block[current_block - 12], 1, write_buffer);
-      } else {
-        // write the data to the current block
-        char write_buffer[BLOCK_SIZE];
-        memcpy(write_buffer, current_buffer, write_size);
-        write_blocks(index_block[current_block - 12], 1, write_buffer);
-      }
+  // map the blocks, allocating the new ones, then write the data
+  int blocks[no_blocks];
+  int mapped = allocate_file_blocks(fileID, &file_inode, first_block,
+                                    no_blocks, blocks);
+  int bytes_written = transfer_file_blocks(
+      blocks, mapped, offset % block_size,
+      min(length, mapped * block_size - offset % block_size), (char *)buf,
+      true, find_no_file_blocks(file_inode.size) - first_block);
 
-      // update file pointer and counters
-      FDT[fileID].offset += write_size;
-      bytes_written += write_size;
-      current_block++;
-      remaining_space_in_block = BLOCK_SIZE;
-      current_buffer += write_size;
-    }
+  // update the size of the file in the inode table
+  if (offset + bytes_written > file_inode.size) {
+    file_inode.size = offset + bytes_written;
   }
 
-  // update the size of the file in the inode table
-  if (FDT[fileID].offset > file_inode.size) {
-    file_inode.size = FDT[fileID].offset;
+  // only mark the inode dirty, it is written back at the next flush point
+  if (memcmp(&inode_table[file_inode_num], &file_inode, sizeof(Inode)) != 0) {
     inode_table[file_inode_num] = file_inode;
+    mark_inode_dirty(file_inode_num);
   }
 
-  // write the updated inode table and free byte map to disk
-  char *buffer = (char *)&inode_table;
-  write_blocks(1, INODE_TABLE_SIZE, buffer);
-  buffer = (char *)&FBM;
-  write_blocks(MAX_BLOCK - NO_FBM_BLOCKS, NO_FBM_BLOCKS, buffer);
-
   return bytes_written;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
+int sfs_fwrite(int fileID, const char *buf, int length) {
+  Call call = begin_call(TRACE_FWRITE, fileID, NULL, -1, length);
+  pthread_rwlock_t *inode_lock = lock_open_file(fileID, true);
   // check if the file is open
-  if (FDT[fileID].inode_num == -1) {
-    return -1;
+  if (inode_lock == NULL) {
+    return end_call(&call, -1);
   }
+  int bytes_written = write_file(fileID, buf, length, FDT[fileID].offset);
+  FDT[fileID].offset += bytes_written;
+  unlock_open_file(fileID, inode_lock);
+  return end_call(&call, bytes_written);
+}
 
-  // find the file inode from the inode table
-  int file_inode_num = FDT[fileID].inode_num;
-  Inode file_inode = inode_table[file_inode_num];
-
-  // calculate the current block and offset within the block
-  int current_block = FDT[fileID].offset / BLOCK_SIZE;
-  int offset_within_block = FDT[fileID].offset % BLOCK_SIZE;
-
-  int following_bytes = BLOCK_SIZE - offset_within_block;
-
-  // initialize variables to keep track of the bytes read and the buffer pointer
-  int bytes_read = 0;
-  char *current_buffer = buf;
-
-  while (bytes_read < length) {
-    // check if the current block is within the direct blocks of the inode
-    if (current_block < 12) {
-      if (file_inode.direct[current_block] == -1) {
-        break;
-      }
-
-      // find the amount of data to read in the current block
-      int read_size = min(following_bytes, length - bytes_read);
-      if (read_size > file_inode.size) {
-        read_size = file_inode.size;
-      }
-
-      if (bytes_read == 0 && read_size <= following_bytes) {
-        // read the remaining bytes in the current block
-        char read_buffer[BLOCK_SIZE];
-        read_blocks(file_inode.direct[current_block], 1, read_buffer);
-        memcpy(current_buffer, read_buffer + offset_within_block, read_size);
-      } else {
-        // read the data from the current block
-        char read_buffer[BLOCK_SIZE];
-        read_blocks(file_inode.direct[current_block], 1, read_buffer);
-        memcpy(current_buffer, read_buffer, read_size);
-      }
+// write at offset without moving the file's offset. The offset can be at
+// most the size of the file, which has no holes.
+int sfs_pwrite(int fileID, const char *buf, int length, int offset) {
+  Call call = begin_call(TRACE_PWRITE, fileID, NULL, offset, length);
+  pthread_rwlock_t *inode_lock = lock_open_file(fileID, true);
+  if (inode_lock == NULL) {
+    return end_call(&call, -1);
+  }
+  int bytes_written = -1;
+  if (offset >= 0 && offset <= inode_table[FDT[fileID].inode_num].size) {
+    bytes_written = write_file(fileID, buf, length, offset);
+  }
+  unlock_open_file(fileID, inode_lock);
+  return end_call(&call, bytes_written);
+}
 
-      // update file pointer and counters
-      FDT[fileID].offset += read_size;
-      bytes_read += read_size;
-      current_block++;
-      current_buffer += read_size;
-      following_bytes = BLOCK_SIZE;
-      offset_within_block = FDT[fileID].offset % BLOCK_SIZE;
-    } else {
-      // if the current block is in the indirect block
-      if (file_inode.indirect == -1) {
-        break;
-      }
+// read ahead for the file open as fileID after a read of logical blocks
+// [first, first + count). Reads that start where the previous one ended are
+// sequential: the window starts at READ_AHEAD_MIN blocks past the read and
+// doubles every time the reader gets within half a window of its end. Any
+// other read closes the window.
+void read_ahead(int fileID, Inode *inode, int first, int count) {
+  File *file = &FDT[fileID];
+  bool sequential = first == file->ra_last || first == file->ra_last + 1;
+  file->ra_last = first + count - 1;
+  if (!sequential) {
+    file->ra_window = 0;
+    return;
+  }
 
-      // read the index block into memory
-      int index_block[BLOCK_SIZE / sizeof(int)];
-      read_blocks(file_inode.indirect, 1, (char *)&index_block);
+  int next = first + count;
+  if (file->ra_window == 0) {
+    file->ra_window = READ_AHEAD_MIN;
+    file->ra_next = next;
+  } else if (next + file->ra_window / 2 <= file->ra_next) {
+    return;
+  } else {
+    file->ra_window = min(file->ra_window * 2, READ_AHEAD_MAX);
+  }
+  // the cache holds read ahead blocks in at most half of its slots
+  file->ra_window = min(file->ra_window, cache_blocks / 2);
+  int start = file->ra_next > next ? file->ra_next : next;
+  int end = min(next + file->ra_window, find_no_file_blocks(inode->size));
+  if (start >= end) {
+    return;
+  }
+  file->ra_next = end;
+
+  // prefetch each run of physically adjacent blocks with a single call
+  int blocks[end - start];
+  map_file_blocks(fileID, inode, start, end - start, blocks);
+  int i = 0;
+  while (i < end - start) {
+    int run = 1;
+    while (i + run < end - start && blocks[i + run] == blocks[i] + run) {
+      run++;
+    }
+    if (blocks[i] != -1) {
+      cache_prefetch_blocks(blocks[i], run);
+    }
+    i += run;
+  }
+}
 
-      // if the current block in the index block is not allocated, break
-      if (index_block[current_block - 12] == -1) {
-        break;
-      }
+// read up to length bytes at offset from the file open as fileID. The caller
+// holds the FDT entry and the inode lock. With unlock_entry set the FDT entry
+// is let go once the blocks are mapped, so that positional reads of one file
+// overlap.
+int read_file(int fileID, char *buf, int length, int offset,
+              bool unlock_entry) {
+  // find the file inode from the inode table
+  Inode *file_inode = &inode_table[FDT[fileID].inode_num];
 
-      // calculate the amount of data to read from the current block
-      int read_size = min(following_bytes, length - bytes_read);
+  // never read past the end of the file
+  length = min(length, file_inode->size - offset);
+  if (length <= 0) {
+    if (unlock_entry) {
+      pthread_mutex_unlock(&FDT[fileID].lock);
+    }
+    return 0;
+  }
 
-      if (bytes_read == 0 && read_size <= following_bytes) {
-        // read the remaining bytes in the current block
-        char read_buffer[BLOCK_SIZE];
-        read_blocks(index_block[current_block - 12], 1, read_buffer);
-        memcpy(current_buffer, read_buffer + offset_within_block, read_size);
-      } else {
-        // read the data from the current block
-        char read_buffer[BLOCK_SIZE];
-        read_blocks(index_block[current_block - 12], 1, read_buffer);
-        memcpy(current_buffer, read_buffer, read_size);
-      }
+  int first_block = offset / block_size;
+  int no_blocks = find_no_file_blocks(offset % block_size + length);
+  int blocks[no_blocks];
+  map_file_blocks(fileID, file_inode, first_block, no_blocks, blocks);
+  read_ahead(fileID, file_inode, first_block, no_blocks);
+  if (unlock_entry) {
+    pthread_mutex_unlock(&FDT[fileID].lock);
+  }
+  return transfer_file_blocks(blocks, no_blocks, offset % block_size, length,
+                              buf, false, 0);
+}
 
-      // update file pointer and counters
-      FDT[fileID].offset += read_size;
-      bytes_read += read_size;
-      current_block++;
-      current_buffer += read_size;
-      following_bytes = BLOCK_SIZE;
-    }
+int sfs_fread(int fileID, char *buf, int length) {
+  Call call = begin_call(TRACE_FREAD, fileID, NULL, -1, length);
+  pthread_rwlock_t *inode_lock = lock_open_file(fileID, false);
+  // check if the file is open
+  if (inode_lock == NULL) {
+    return end_call(&call, -1);
   }
+  int bytes_read = read_file(fileID, buf, length, FDT[fileID].offset, false);
+  FDT[fileID].offset += bytes_read;
+  unlock_open_file(fileID, inode_lock);
+  return end_call(&call, bytes_read);
+}
 
-  return bytes_read;
+// read at offset without moving the file's offset. The FDT entry is only
+// held until the blocks are mapped, so reads of one file run side by side.
+int sfs_pread(int fileID, char *buf, int length, int offset) {
+  Call call = begin_call(TRACE_PREAD, fileID, NULL, offset, length);
+  if (offset < 0) {
+    return end_call(&call, -1);
+  }
+  pthread_rwlock_t *inode_lock = lock_open_file(fileID, false);
+  if (inode_lock == NULL) {
+    return end_call(&call, -1);
+  }
+  int bytes_read = read_file(fileID, buf, length, offset, true);
+  pthread_rwlock_unlock(inode_lock);
+  pthread_rwlock_unlock(&fs_lock);
+  return end_call(&call, bytes_read);
 }
 
 int sfs_fseek(int fileID, int loc) {
+  Call call = begin_call(TRACE_FSEEK, fileID, NULL, loc, -1);
+  pthread_rwlock_t *inode_lock = lock_open_file(fileID, true);
   // check if the file is open
-  if (FDT[fileID].inode_num == -1) {
-    return -1;
+  if (inode_lock == NULL) {
+    return end_call(&call, -1);
   }
+  int status = -1;
   // check if the location is valid
-  if (loc < 0 || loc > inode_table[FDT[fileID].inode_num].size) {
-    return -1;
+  if (loc >= 0 && loc <= inode_table[FDT[fileID].inode_num].size) {
+    flush_tail(fileID);
+    // set the file descriptor table entry
+    FDT[fileID].offset = loc;
+    status = 0;
   }
-  // set the file descriptor table entry
-  FDT[fileID].offset = loc;
+  unlock_open_file(fileID, inode_lock);
+  return end_call(&call, status);
+}
 
-  return 0;
+// empty the file open as fileID. Unlike removing and recreating it, this
+// keeps its inode, so the file stays open for everyone sharing the fd.
+int sfs_ftruncate(int fileID) {
+  Call call = begin_call(TRACE_FTRUNCATE, fileID, NULL, -1, -1);
+  pthread_rwlock_t *inode_lock = lock_open_file(fileID, true);
+  if (inode_lock == NULL) {
+    return end_call(&call, -1);
+  }
+  drop_tail(fileID);
+  drop_block_map(fileID);
+  pthread_mutex_lock(&alloc_lock);
+  release_prealloc(fileID);
+  free_file_blocks(FDT[fileID].inode_num);
+  pthread_mutex_unlock(&alloc_lock);
+  FDT[fileID].offset = 0;
+  FDT[fileID].ra_last = -1;
+  FDT[fileID].ra_window = 0;
+  unlock_open_file(fileID, inode_lock);
+  return end_call(&call, 0);
 }
 
-int sfs_remove(char *file) {
+// the caller holds dir_lock exclusively and fdt_lock
+int remove_file(char *file) {
+  if (!mounted) {
+    return -1;
+  }
   // search for the file in the root directory
   int file_inode_num = -1;
-  for (int i = 0; i < MAX_FILE_NO; i++) {
-    if (root_dir[i].used && strcmp(root_dir[i].file_name, file) == 0) {
-      // found the file in the root directory
-      file_inode_num = root_dir[i].inode_num;
-      root_dir[i].used = false;
-      break;
-    }
+  int dir_entry = dir_lookup(file);
+  if (dir_entry != -1) {
+    file_inode_num = root_dir[dir_entry].inode_num;
+    dir_index_remove(dir_entry);
+    root_dir[dir_entry].used = false;
+    mark_root_dir_dirty(dir_entry);
   }
 
   // ff the file is not found, return -1
@@ -581,50 +2454,51 @@ int sfs_remove(char *file) {
     return -1;
   }
 
-  // get the inode of the file from the inode table
-  Inode file_inode = inode_table[file_inode_num];
-
-  // free the data blocks used by the file
-  for (int i = 0; i < 12; i++) {
-    if (file_inode.direct[i] != -1) {
-      FBM[file_inode.direct[i]] = 0;
-    }
-  }
-
-  // if the file has an indirect block, free its data blocks
-  if (file_inode.indirect != -1) {
-    int indirect_block[BLOCK_SIZE / sizeof(int)];
-    read_blocks(file_inode.indirect, 1, (char *)&indirect_block);
-    for (int i = 0; i < BLOCK_SIZE / sizeof(int); i++) {
-      if (indirect_block[i] != -1) {
-        FBM[indirect_block[i]] = 0;
-      }
+  // drop the tail buffer, the preallocation window and the block map cache
+  // of the file if it is still open, and detach it from the inode, which the
+  // next file created may take
+  for (int i = 0; i < max_file_no; i++) {
+    if (FDT[i].inode_num == file_inode_num && !FDT[i].removed) {
+      pthread_mutex_lock(&FDT[i].lock);
+      drop_tail(i);
+      pthread_mutex_lock(&alloc_lock);
+      release_prealloc(i);
+      pthread_mutex_unlock(&alloc_lock);
+      drop_block_map(i);
+      FDT[i].removed = true;
+      pthread_mutex_unlock(&FDT[i].lock);
     }
-    FBM[file_inode.indirect] = 0;
   }
 
-  // mark the inode as free in the inode table
+  // free the data blocks used by the file and mark its inode as free
+  pthread_rwlock_wrlock(&inode_locks[file_inode_num]);
+  pthread_mutex_lock(&alloc_lock);
+  free_file_blocks(file_inode_num);
+  pthread_mutex_unlock(&alloc_lock);
   inode_table[file_inode_num].size = -1;
-  for (int i = 0; i < 12; i++) {
-    inode_table[file_inode_num].direct[i] = -1;
-  }
-  inode_table[file_inode_num].indirect = -1;
-
-  // write the updated root directory, inode table, and free byte map to disk
-  char *buffer = (char *)&root_dir;
-  write_blocks(DATA_BLOCK_START, 1, buffer);
-
-  buffer = (char *)&inode_table;
-  write_blocks(1, INODE_TABLE_SIZE, buffer);
-
-  buffer = (char *)&FBM;
-  write_blocks(MAX_BLOCK - NO_FBM_BLOCKS, NO_FBM_BLOCKS, buffer);
+  pthread_rwlock_unlock(&inode_locks[file_inode_num]);
 
   return 0;
 }
 
-int sfs_getnextfilename(char *fname) {
-  while (next_file_index < MAX_FILE_NO) {
+int sfs_remove(char *file) {
+  Call call = begin_call(TRACE_REMOVE, -1, file, -1, -1);
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_wrlock(&dir_lock);
+  pthread_mutex_lock(&fdt_lock);
+  int status = remove_file(file);
+  pthread_mutex_unlock(&fdt_lock);
+  pthread_rwlock_unlock(&dir_lock);
+  pthread_rwlock_unlock(&fs_lock);
+  return end_call(&call, status);
+}
+
+// the caller holds dir_lock exclusively
+int next_file_name(char *fname) {
+  if (!mounted) {
+    return 0;
+  }
+  while (next_file_index < max_file_no) {
     if (root_dir[next_file_index].used) {
       strcpy(fname, root_dir[next_file_index].file_name);
       next_file_index++;
@@ -639,13 +2513,30 @@ int sfs_getnextfilename(char *fname) {
   return 0;
 }
 
+int sfs_getnextfilename(char *fname) {
+  Call call = begin_call(TRACE_GETNEXTFILENAME, -1, NULL, -1, -1);
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_wrlock(&dir_lock);
+  int found = next_file_name(fname);
+  pthread_rwlock_unlock(&dir_lock);
+  pthread_rwlock_unlock(&fs_lock);
+  return end_call(&call, found);
+}
+
 int sfs_getfilesize(const char *path) {
-  for (int i = 0; i < MAX_FILE_NO; i++) {
-    if (root_dir[i].used && strcmp(root_dir[i].file_name, path) == 0) {
-      int file_inode_num = root_dir[i].inode_num;
-      return inode_table[file_inode_num].size;
-    }
+  Call call = begin_call(TRACE_GETFILESIZE, -1, path, -1, -1);
+  int size = -1;
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_rdlock(&dir_lock);
+  int dir_entry = mounted ? dir_lookup(path) : -1;
+  if (dir_entry != -1) {
+    int file_inode_num = root_dir[dir_entry].inode_num;
+    pthread_rwlock_rdlock(&inode_locks[file_inode_num]);
+    size = inode_table[file_inode_num].size;
+    pthread_rwlock_unlock(&inode_locks[file_inode_num]);
   }
+  pthread_rwlock_unlock(&dir_lock);
+  pthread_rwlock_unlock(&fs_lock);
   // If the file is not found, return -1
-  return -1;
+  return end_call(&call, size);
 }
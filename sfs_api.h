@@ -1,11 +1,26 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include "block_cache.h"
+#include "disk_emu.h"
+
 // You can add more into this file.
 #define MAXFILENAME 16
 
 void mksfs(int);
 
+// geometry of a freshly formatted file system
+typedef struct sfs_geometry {
+  int block_size;  // bytes per block, a power of two from 512 to 65536
+  int num_blocks;  // blocks on the disk
+  int num_inodes;  // files the file system can hold, root directory included
+} SfsGeometry;
+
+// formats with a journal as large as the inode table, free block map and
+// root directory together, plus its header blocks, unless the disk is too
+// small for it, in which case metadata is written in place at every sync
+int mksfs_geometry(int, const SfsGeometry*);
+
 int sfs_getnextfilename(char*);
 
 int sfs_getfilesize(const char*);
@@ -18,8 +33,81 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
+// read and write at an offset, leaving the file's offset alone
+int sfs_pread(int, char*, int, int);
+
+int sfs_pwrite(int, const char*, int, int);
+
 int sfs_fseek(int, int);
 
+// a file removed while open stays open, but closing it is all that works
 int sfs_remove(char*);
 
+// empty an open file
+int sfs_ftruncate(int);
+
+int sfs_sync();
+
+int sfs_fsync(int);
+
+// group commit of concurrent syncs: each commit covers every sync waiting
+// for it, and first waits up to the delay (microseconds) for more to join
+typedef struct sync_stats {
+  long requests;  // sfs_sync and sfs_fsync calls
+  long commits;   // syncs of the file system done for them
+  long batched;   // requests covered by those syncs, over commits on average
+} SyncStats;
+
+void sfs_set_sync_delay(int);
+
+void sfs_get_sync_stats(SyncStats*);
+
+void sfs_reset_sync_stats();
+
+// API calls timed by the statistics
+#define SFS_OP_FOPEN 0
+#define SFS_OP_FCLOSE 1
+#define SFS_OP_FREAD 2   // sfs_fread and sfs_pread
+#define SFS_OP_FWRITE 3  // sfs_fwrite and sfs_pwrite
+#define SFS_OP_REMOVE 4
+#define SFS_OP_SYNC 5    // sfs_sync and sfs_fsync
+#define SFS_OPS 6
+#define SFS_LATENCY_BUCKETS 21
+
+typedef struct sfs_op_stats {
+  long calls;
+  long errors;    // calls that failed
+  long bytes;     // moved by reads and writes
+  long total_ns;  // time spent in the calls
+  // bucket i counts the calls that took under 2^i microseconds, the last
+  // one every longer call
+  long histogram[SFS_LATENCY_BUCKETS];
+} SfsOpStats;
+
+// statistics since the last sfs_reset_stats. Building with SFS_NO_STATS
+// compiles out the call, allocator and disk counters, which then stay 0.
+typedef struct sfs_stats {
+  SfsOpStats ops[SFS_OPS];
+  long alloc_searches;  // searches of the FBM for free blocks
+  long alloc_words;     // FBM words they looked at
+  long alloc_longest;   // most words looked at by a single search
+  DiskStats disk;
+  CacheStats cache;
+  SyncStats sync;
+} SfsStats;
+
+void sfs_get_stats(SfsStats*);
+
+void sfs_reset_stats();
+
+// print every statistic to stdout
+void sfs_dump_stats();
+
+// trace every call to a file (see sfs_trace.h), replayed by sfs_replay
+int sfs_trace_start(const char*);
+
+void sfs_trace_stop();
+
+void sfs_set_cache_size(int);
+
 #endif
@@ -0,0 +1,436 @@
+/* sfs_bench.c
+ *
+ * Benchmark suite for the SFS API, run against a fresh my_sfs image.
+ *
+ *   sfs_bench [-t max_threads] [-l latency] [-m model] [-s] [benchmark ...]
+ *
+ * With no benchmark named, all of them run in turn:
+ *
+ *   seq_write    sequential writes of a FILE_BYTES file, 4KB, 64KB and 1MB
+ *   seq_read     reads of that file back, in the same sizes
+ *   rand_write   4KB sfs_pwrite calls at random block aligned offsets
+ *   rand_read    4KB sfs_pread calls at random block aligned offsets
+ *   append       64 byte appends, which go through the tail buffer
+ *   create       creating, writing and closing small files, then removing
+ *                them (remove)
+ *   list         full passes of sfs_getnextfilename over a full directory
+ *   parallel     reads of FILES files by 1, 2, 4 ... max_threads threads
+ *                (8 by default), each taking whole files in turn
+ *
+ * Every operation is timed on its own. The report gives the number of
+ * operations, their rate and throughput over the time spent in them, and
+ * the median and 99th percentile of their latencies. The emulated disk has
+ * no latency unless -l sets one in microseconds per block written, or -m
+ * models a fixed, hdd or ssd device (DISK_EMU_MODEL does too), so the file
+ * system itself is measured. -s prints the file system statistics gathered
+ * over the whole run at the end, the simulated device time among them.
+ * Sequential writes that reach the disk one block per write count as
+ * failures, as the cache and the bypass both should gather them into runs.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define FILES 16
+#define FILE_BYTES (16 * 1024 * 1024)
+#define PARALLEL_FILE_BYTES (2 * 1024 * 1024)
+#define CHUNK 65536
+#define MAX_CHUNK (1024 * 1024)
+#define RANDOM_OPS 4000
+#define APPENDS 50000
+#define APPEND_BYTES 64
+#define STORM_FILES 64  // files created at once, the image has 100 inodes
+#define STORM_ROUNDS 20
+#define LIST_PASSES 2000
+#define MAX_OPS 200000
+
+static SfsGeometry geometry = {4096, 16384, 100};  // a 64MB image
+
+static char names[FILES][MAXFILENAME];
+static int next_file;  // next file for a reader to take
+static pthread_mutex_t next_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int errors;
+
+// latencies of the operations of the benchmark being run, in seconds
+static double latencies[MAX_OPS];
+static int ops;
+static long bytes;
+static char buffer[MAX_CHUNK];
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the byte at a given offset of a given file
+char pattern(int file, int offset) { return (char)(file * 131 + offset / 7); }
+
+void start_run() {
+  ops = 0;
+  bytes = 0;
+}
+
+// record an operation that started at start and moved some bytes
+void record(double start, long moved) {
+  if (ops < MAX_OPS) {
+    latencies[ops++] = now() - start;
+  }
+  bytes += moved;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+void report(const char *name) {
+  double seconds = 0;
+  for (int i = 0; i < ops; i++) {
+    seconds += latencies[i];
+  }
+  qsort(latencies, ops, sizeof(double), compare_doubles);
+  double p50 = ops > 0 ? latencies[ops / 2] : 0;
+  double p99 = ops > 0 ? latencies[(int)(ops * 0.99)] : 0;
+  printf("%-16s %8d %12.0f ", name, ops, seconds > 0 ? ops / seconds : 0);
+  if (bytes > 0) {
+    printf("%10.1f ", bytes / seconds / (1024 * 1024));
+  } else {
+    printf("%10s ", "-");
+  }
+  printf("%10.1f %10.1f\n", p50 * 1e6, p99 * 1e6);
+}
+
+void seq_write(int fd, int size) {
+  sfs_fseek(fd, 0);
+  for (int offset = 0; offset < FILE_BYTES; offset += size) {
+    for (int j = 0; j < size; j += 512) {
+      buffer[j] = pattern(0, offset + j);
+    }
+    double start = now();
+    if (sfs_fwrite(fd, buffer, size) != size) {
+      errors++;
+    }
+    record(start, size);
+  }
+}
+
+void seq_read(int fd, int size) {
+  sfs_fseek(fd, 0);
+  for (int offset = 0; offset < FILE_BYTES; offset += size) {
+    double start = now();
+    if (sfs_fread(fd, buffer, size) != size ||
+        buffer[size - 512] != pattern(0, offset + size - 512)) {
+      errors++;
+    }
+    record(start, size);
+  }
+}
+
+// sequential writes must reach the disk in runs of several blocks, whether
+// the block cache gathered them on their way out or they bypassed it. A
+// memory mapped disk takes every block as it is written, so it is left out.
+void check_runs(const char *name, const DiskStats *before) {
+  if (get_block_ptr(0) != NULL) {
+    return;
+  }
+  DiskStats after;
+  disk_get_stats(&after);
+  long writes = after.writes - before->writes;
+  long blocks = after.blocks_written - before->blocks_written;
+  if (writes > 0 && blocks < 2 * writes) {
+    printf("%s: %ld disk writes of %ld blocks\n", name, writes, blocks);
+    errors++;
+  }
+}
+
+void bench_sequential(bool reads) {
+  int sizes[] = {4096, CHUNK, MAX_CHUNK};
+  int fd = sfs_fopen("seq");
+  for (int i = 0; i < 3; i++) {
+    char name[32];
+    sprintf(name, "%s_%dk", reads ? "seq_read" : "seq_write",
+            sizes[i] / 1024);
+    if (reads && sfs_getfilesize("seq") < FILE_BYTES) {
+      seq_write(fd, CHUNK);
+    }
+    DiskStats before;
+    disk_get_stats(&before);
+    start_run();
+    if (reads) {
+      seq_read(fd, sizes[i]);
+    } else {
+      seq_write(fd, sizes[i]);
+    }
+    report(name);
+    if (!reads) {
+      check_runs(name, &before);
+    }
+  }
+  sfs_fclose(fd);
+}
+
+void bench_random(bool reads) {
+  int fd = sfs_fopen("seq");
+  if (sfs_getfilesize("seq") < FILE_BYTES) {
+    seq_write(fd, CHUNK);
+  }
+  srand(1);
+  start_run();
+  for (int i = 0; i < RANDOM_OPS; i++) {
+    int offset = rand() % (FILE_BYTES / 4096) * 4096;
+    double start = now();
+    int moved = reads ? sfs_pread(fd, buffer, 4096, offset)
+                      : sfs_pwrite(fd, buffer, 4096, offset);
+    if (moved != 4096) {
+      errors++;
+    }
+    record(start, moved);
+  }
+  sfs_fclose(fd);
+  report(reads ? "rand_read_4k" : "rand_write_4k");
+}
+
+void bench_append() {
+  int fd = sfs_fopen("append");
+  memset(buffer, 'a', APPEND_BYTES);
+  start_run();
+  for (int i = 0; i < APPENDS; i++) {
+    double start = now();
+    if (sfs_fwrite(fd, buffer, APPEND_BYTES) != APPEND_BYTES) {
+      errors++;
+    }
+    record(start, APPEND_BYTES);
+  }
+  sfs_fclose(fd);
+  sfs_remove("append");
+  report("append_64");
+}
+
+void bench_create_remove() {
+  char name[MAXFILENAME];
+  double removes[STORM_FILES * STORM_ROUNDS];
+  int no_removes = 0;
+  memset(buffer, 'c', 100);
+  start_run();
+  for (int round = 0; round < STORM_ROUNDS; round++) {
+    for (int i = 0; i < STORM_FILES; i++) {
+      sprintf(name, "storm%d", i);
+      double start = now();
+      int fd = sfs_fopen(name);
+      if (fd < 0 || sfs_fwrite(fd, buffer, 100) != 100) {
+        errors++;
+      }
+      sfs_fclose(fd);
+      record(start, 100);
+    }
+    for (int i = 0; i < STORM_FILES; i++) {
+      sprintf(name, "storm%d", i);
+      double start = now();
+      if (sfs_remove(name) < 0) {
+        errors++;
+      }
+      removes[no_removes++] = now() - start;
+    }
+  }
+  report("create");
+
+  start_run();
+  memcpy(latencies, removes, no_removes * sizeof(double));
+  ops = no_removes;
+  report("remove");
+}
+
+void bench_list() {
+  char name[MAXFILENAME];
+  for (int i = 0; i < STORM_FILES; i++) {
+    sprintf(name, "list%d", i);
+    sfs_fclose(sfs_fopen(name));
+  }
+  start_run();
+  for (int pass = 0; pass < LIST_PASSES; pass++) {
+    int found = 0;
+    double start = now();
+    while (sfs_getnextfilename(name)) {
+      found++;
+    }
+    record(start, 0);
+    if (found != STORM_FILES) {
+      errors++;
+    }
+  }
+  for (int i = 0; i < STORM_FILES; i++) {
+    sprintf(name, "list%d", i);
+    sfs_remove(name);
+  }
+  report("list");
+}
+
+void write_files() {
+  char *chunk = malloc(CHUNK);
+  for (int i = 0; i < FILES; i++) {
+    sprintf(names[i], "bench%d", i);
+    int fd = sfs_fopen(names[i]);
+    for (int offset = 0; offset < PARALLEL_FILE_BYTES; offset += CHUNK) {
+      for (int j = 0; j < CHUNK; j++) {
+        chunk[j] = pattern(i, offset + j);
+      }
+      sfs_fwrite(fd, chunk, CHUNK);
+    }
+    sfs_fclose(fd);
+  }
+  free(chunk);
+}
+
+void *reader(void *arg) {
+  char *chunk = malloc(CHUNK);
+  while (1) {
+    pthread_mutex_lock(&next_file_lock);
+    int i = next_file++;
+    pthread_mutex_unlock(&next_file_lock);
+    if (i >= FILES) {
+      break;
+    }
+
+    int fd = sfs_fopen(names[i]);
+    sfs_fseek(fd, 0);
+    for (int offset = 0; offset < PARALLEL_FILE_BYTES; offset += CHUNK) {
+      if (sfs_fread(fd, chunk, CHUNK) != CHUNK ||
+          chunk[CHUNK - 1] != pattern(i, offset + CHUNK - 1)) {
+        __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+    sfs_fclose(fd);
+  }
+  free(chunk);
+  return arg;
+}
+
+double parallel_read(int threads) {
+  pthread_t tids[threads];
+  next_file = 0;
+  double start = now();
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, reader, NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  return now() - start;
+}
+
+void bench_parallel(int max_threads) {
+  write_files();
+  double total_mb = (double)FILES * PARALLEL_FILE_BYTES / (1024 * 1024);
+  printf("\nparallel read, %d files of %d KB\n", FILES,
+         PARALLEL_FILE_BYTES / 1024);
+  printf("%8s %10s %10s\n", "threads", "seconds", "MB/s");
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    double seconds = parallel_read(threads);
+    printf("%8d %10.3f %10.1f\n", threads, seconds, total_mb / seconds);
+  }
+  for (int i = 0; i < FILES; i++) {
+    sfs_remove(names[i]);
+  }
+}
+
+// whether the benchmark called name was asked for, all of them by default
+bool wanted(int argc, char *argv[], int first, const char *name) {
+  if (first == argc) {
+    return true;
+  }
+  for (int i = first; i < argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  int max_threads = 8;
+  double latency = 0;
+  const char *model_name = NULL;
+  bool dump_stats = false;
+  int first = 1;
+  while (first < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-s") == 0) {
+      dump_stats = true;
+      first++;
+      continue;
+    }
+    if (first + 1 == argc) {
+      break;
+    }
+    if (strcmp(argv[first], "-t") == 0) {
+      max_threads = atoi(argv[first + 1]);
+    } else if (strcmp(argv[first], "-l") == 0) {
+      latency = atof(argv[first + 1]);
+    } else if (strcmp(argv[first], "-m") == 0) {
+      model_name = argv[first + 1];
+    }
+    first += 2;
+  }
+
+  DiskModel model;
+  if (model_name != NULL && disk_model_by_name(model_name, &model) < 0) {
+    fprintf(stderr, "unknown device model %s\n", model_name);
+    return 1;
+  }
+  if (latency > 0) {
+    disk_set_latency(latency);
+  }
+  if (model_name != NULL) {
+    disk_set_model(&model);
+  }
+  if (mksfs_geometry(1, &geometry) < 0) {
+    fprintf(stderr, "cannot format my_sfs\n");
+    return 1;
+  }
+  sfs_reset_stats();
+
+  printf("%-16s %8s %12s %10s %10s %10s\n", "benchmark", "ops", "ops/s",
+         "MB/s", "p50 us", "p99 us");
+  if (wanted(argc, argv, first, "seq_write")) {
+    bench_sequential(false);
+  }
+  if (wanted(argc, argv, first, "seq_read")) {
+    bench_sequential(true);
+  }
+  if (wanted(argc, argv, first, "rand_write")) {
+    bench_random(false);
+  }
+  if (wanted(argc, argv, first, "rand_read")) {
+    bench_random(true);
+  }
+  sfs_remove("seq");
+  if (wanted(argc, argv, first, "append")) {
+    bench_append();
+  }
+  if (wanted(argc, argv, first, "create")) {
+    bench_create_remove();
+  }
+  if (wanted(argc, argv, first, "list")) {
+    bench_list();
+  }
+  if (wanted(argc, argv, first, "parallel")) {
+    bench_parallel(max_threads);
+  }
+
+  if (dump_stats) {
+    printf("\n");
+    sfs_dump_stats();
+  }
+  if (errors > 0) {
+    printf("%d operations failed or read back wrong\n", errors);
+  }
+  return errors > 0;
+}
@@ -0,0 +1,296 @@
+/* sfs_replay.c
+ *
+ * Replays a trace written by sfs_trace_start (see sfs_trace.h) against a
+ * fresh my_sfs image.
+ *
+ *   sfs_replay [-l latency] [-m model] [-s] trace
+ *
+ * The image is formatted with the geometry the trace records, then the calls
+ * are made one after the other as fast as possible. Files keep the names
+ * they had, and each descriptor of the trace is mapped to the one its
+ * sfs_fopen returns in the replay. The trace holds no data, so writes write
+ * a fixed pattern. A call whose result differs from the traced one in
+ * success or failure is counted as diverging.
+ *
+ * The report gives, for each kind of call, the number made, their rate and
+ * throughput over the time spent in them, and the median and 99th
+ * percentile latency of the replay next to the traced ones. -l gives the
+ * emulated disk a latency in microseconds per block written, -m models a
+ * fixed, hdd or ssd device instead, and -s prints the file system
+ * statistics at the end.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+#include "sfs_trace.h"
+
+static const char *op_names[TRACE_OPS] = {
+    "fopen", "fclose", "fread",        "fwrite",      "pread", "pwrite",
+    "fseek", "remove", "nextfilename", "getfilesize", "sync",  "fsync",
+    "ftruncate"};
+
+// latencies of the calls of one kind, in seconds, in the replay and in the
+// trace
+typedef struct op_latencies {
+  double *replayed;
+  double *traced;
+  int calls;
+  int capacity;
+  long bytes;
+} OpLatencies;
+
+static OpLatencies latencies[TRACE_OPS];
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void record(int op, double replayed, double traced, int moved) {
+  OpLatencies *op_latencies = &latencies[op];
+  if (op_latencies->calls == op_latencies->capacity) {
+    op_latencies->capacity =
+        op_latencies->capacity == 0 ? 1024 : 2 * op_latencies->capacity;
+    op_latencies->replayed = realloc(op_latencies->replayed,
+                                     op_latencies->capacity * sizeof(double));
+    op_latencies->traced = realloc(op_latencies->traced,
+                                   op_latencies->capacity * sizeof(double));
+  }
+  op_latencies->replayed[op_latencies->calls] = replayed;
+  op_latencies->traced[op_latencies->calls] = traced;
+  op_latencies->calls++;
+  if ((op == TRACE_FREAD || op == TRACE_FWRITE || op == TRACE_PREAD ||
+       op == TRACE_PWRITE) &&
+      moved > 0) {
+    op_latencies->bytes += moved;
+  }
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// the given fraction of sorted latencies, in microseconds
+double percentile(double *sorted, int count, double fraction) {
+  return sorted[(int)(count * fraction)] * 1e6;
+}
+
+void report() {
+  printf("%-13s %8s %12s %10s %10s %10s %10s %10s\n", "call", "calls",
+         "ops/s", "MB/s", "p50 us", "p99 us", "traced p50", "traced p99");
+  for (int op = 0; op < TRACE_OPS; op++) {
+    OpLatencies *op_latencies = &latencies[op];
+    int calls = op_latencies->calls;
+    if (calls == 0) {
+      continue;
+    }
+    double seconds = 0;
+    for (int i = 0; i < calls; i++) {
+      seconds += op_latencies->replayed[i];
+    }
+    qsort(op_latencies->replayed, calls, sizeof(double), compare_doubles);
+    qsort(op_latencies->traced, calls, sizeof(double), compare_doubles);
+    printf("%-13s %8d %12.0f ", op_names[op], calls,
+           seconds > 0 ? calls / seconds : 0);
+    if (op_latencies->bytes > 0) {
+      printf("%10.1f ", op_latencies->bytes / seconds / (1024 * 1024));
+    } else {
+      printf("%10s ", "-");
+    }
+    printf("%10.1f %10.1f %10.1f %10.1f\n",
+           percentile(op_latencies->replayed, calls, 0.5),
+           percentile(op_latencies->replayed, calls, 0.99),
+           percentile(op_latencies->traced, calls, 0.5),
+           percentile(op_latencies->traced, calls, 0.99));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  double latency = 0;
+  const char *model_name = NULL;
+  bool dump_stats = false;
+  int first = 1;
+  while (first < argc - 1 && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-s") == 0) {
+      dump_stats = true;
+      first++;
+    } else if (strcmp(argv[first], "-l") == 0 && first + 2 < argc) {
+      latency = atof(argv[first + 1]);
+      first += 2;
+    } else if (strcmp(argv[first], "-m") == 0 && first + 2 < argc) {
+      model_name = argv[first + 1];
+      first += 2;
+    } else {
+      break;
+    }
+  }
+  if (first != argc - 1) {
+    fprintf(stderr, "usage: sfs_replay [-l latency] [-m model] [-s] trace\n");
+    return 1;
+  }
+
+  FILE *trace = fopen(argv[first], "rb");
+  TraceHeader header;
+  if (trace == NULL || fread(&header, sizeof(header), 1, trace) != 1 ||
+      header.magic != SFS_TRACE_MAGIC ||
+      header.version != SFS_TRACE_VERSION) {
+    fprintf(stderr, "%s is not an SFS trace\n", argv[first]);
+    return 1;
+  }
+  SfsGeometry geometry = {header.block_size, header.num_blocks,
+                          header.num_inodes};
+  DiskModel model;
+  if (model_name != NULL && disk_model_by_name(model_name, &model) < 0) {
+    fprintf(stderr, "unknown device model %s\n", model_name);
+    return 1;
+  }
+  if (latency > 0) {
+    disk_set_latency(latency);
+  }
+  if (model_name != NULL) {
+    disk_set_model(&model);
+  }
+  if (mksfs_geometry(1, &geometry) < 0) {
+    fprintf(stderr, "cannot format my_sfs\n");
+    return 1;
+  }
+  sfs_reset_stats();
+
+  // descriptors of the trace mapped to the replay's, -1 when not open.
+  // sfs_fclose frees its descriptor before its sync and is traced after it,
+  // so concurrent sfs_fopen calls can be traced reusing the descriptor
+  // before the close is. The replay's descriptors left to close for each
+  // descriptor of the trace are stacked in closing, linked by next_closing,
+  // and the close of any of them stands for the close in the trace.
+  int *fds = malloc(header.num_inodes * sizeof(int));
+  int *closing = malloc(header.num_inodes * sizeof(int));
+  int *next_closing = malloc(header.num_inodes * sizeof(int));
+  for (int i = 0; i < header.num_inodes; i++) {
+    fds[i] = -1;
+    closing[i] = -1;
+  }
+  char *buffer = NULL;
+  int buffer_size = 0;
+  long calls = 0;
+  long diverged = 0;
+  double replayed_seconds = 0;
+  int64_t traced_end = 0;
+
+  TraceRecord rec;
+  char name[UINT8_MAX + 1];
+  while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+    if (rec.op >= TRACE_OPS ||
+        fread(name, 1, rec.name_len, trace) != rec.name_len) {
+      fprintf(stderr, "truncated or corrupt trace after %ld calls\n", calls);
+      break;
+    }
+    name[rec.name_len] = '\0';
+    int fd = rec.fd;
+    bool known = fd >= 0 && fd < header.num_inodes;
+    if (known && rec.op == TRACE_FCLOSE && closing[fd] != -1) {
+      fd = closing[fd];
+    } else if (known && fds[fd] != -1) {
+      fd = fds[fd];
+    }
+    if (rec.length > buffer_size) {
+      buffer_size = rec.length;
+      buffer = realloc(buffer, buffer_size);
+      memset(buffer, 'r', buffer_size);
+    }
+
+    int result = -1;
+    double start = now();
+    switch (rec.op) {
+      case TRACE_FOPEN:
+        result = sfs_fopen(name);
+        break;
+      case TRACE_FCLOSE:
+        result = sfs_fclose(fd);
+        break;
+      case TRACE_FREAD:
+        result = sfs_fread(fd, buffer, rec.length);
+        break;
+      case TRACE_FWRITE:
+        result = sfs_fwrite(fd, buffer, rec.length);
+        break;
+      case TRACE_PREAD:
+        result = sfs_pread(fd, buffer, rec.length, rec.offset);
+        break;
+      case TRACE_PWRITE:
+        result = sfs_pwrite(fd, buffer, rec.length, rec.offset);
+        break;
+      case TRACE_FSEEK:
+        result = sfs_fseek(fd, rec.offset);
+        break;
+      case TRACE_REMOVE:
+        result = sfs_remove(name);
+        break;
+      case TRACE_GETNEXTFILENAME:
+        result = sfs_getnextfilename(name);
+        break;
+      case TRACE_GETFILESIZE:
+        result = sfs_getfilesize(name);
+        break;
+      case TRACE_SYNC:
+        result = sfs_sync();
+        break;
+      case TRACE_FSYNC:
+        result = sfs_fsync(fd);
+        break;
+      case TRACE_FTRUNCATE:
+        result = sfs_ftruncate(fd);
+        break;
+    }
+    double seconds = now() - start;
+    record(rec.op, seconds, rec.latency_ns / 1e9, result);
+    replayed_seconds += seconds;
+    calls++;
+
+    if ((result < 0) != (rec.result < 0)) {
+      diverged++;
+    }
+    if (rec.op == TRACE_FOPEN && rec.result >= 0 &&
+        rec.result < header.num_inodes) {
+      // opening an open file returns its descriptor again
+      if (fds[rec.result] != -1 && fds[rec.result] != result) {
+        next_closing[fds[rec.result]] = closing[rec.result];
+        closing[rec.result] = fds[rec.result];
+      }
+      fds[rec.result] = result;
+    } else if (rec.op == TRACE_FCLOSE && result == 0 && known) {
+      if (closing[rec.fd] != -1) {
+        closing[rec.fd] = next_closing[closing[rec.fd]];
+      } else {
+        fds[rec.fd] = -1;
+      }
+    }
+    if (rec.time_ns + (int64_t)rec.latency_ns > traced_end) {
+      traced_end = rec.time_ns + rec.latency_ns;
+    }
+  }
+  fclose(trace);
+
+  report();
+  printf("\n%ld calls replayed in %.3f s, traced over %.3f s\n", calls,
+         replayed_seconds, traced_end / 1e9);
+  if (diverged > 0) {
+    printf("%ld calls succeeded or failed unlike in the trace\n", diverged);
+  }
+  if (dump_stats) {
+    printf("\n");
+    sfs_dump_stats();
+  }
+  free(fds);
+  free(closing);
+  free(next_closing);
+  free(buffer);
+  return 0;
+}
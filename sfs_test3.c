@@ -0,0 +1,186 @@
+/* sfs_test3.c
+ *
+ * Crash recovery test. Each step runs in a child process that mounts the
+ * file system and exits without closing anything, which is a crash as far
+ * as the file system can tell. A step makes changes after its last sync,
+ * and the next one checks that only what was synced survived, and that
+ * nothing written after the sync can still overwrite it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 1024              /* block size of a default file system */
+#define SYNCED_BLOCKS 14        /* blocks of a file written before a sync,
+                                   past the direct ones */
+#define LOST_BLOCKS 600         /* blocks appended to it before the crash */
+#define NEW_BLOCKS 20           /* blocks written after the remount */
+#define FILLER_BLOCKS 1000      /* blocks written to reuse freed ones */
+#define CACHE_BLOCKS 16         /* blocks of the block cache */
+#define REMOVED_BLOCKS 40       /* blocks of the file removed before the crash */
+
+static int error_count = 0;
+
+/* run() - run a step in a child process, which mounts the file system
+ * (formatting it when fresh is set) and exits without unmounting it.
+ * That is a crash as far as the file system can tell. Each step runs in
+ * a process of its own since a mounted file system keeps threads, which
+ * a forked process would not have, and would flush its state over the
+ * image of the next step.
+ */
+void run(void (*step)(void), int fresh)
+{
+  pid_t pid = fork();
+  int status;
+
+  if (pid == 0) {
+    /* a small cache writes blocks back early, as a busy one would */
+    sfs_set_cache_size(CACHE_BLOCKS);
+    mksfs(fresh);
+    step();
+    _exit(error_count);
+  }
+  waitpid(pid, &status, 0);
+  error_count += WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/* write_filled() - write count blocks filled with c to an open file in
+ * one call, which bypasses the block cache when it is long enough.
+ */
+void write_filled(int fd, char c, int count)
+{
+  char *buffer = malloc(count * BLOCK);
+
+  memset(buffer, c, count * BLOCK);
+  if (sfs_fwrite(fd, buffer, count * BLOCK) != count * BLOCK) {
+    fprintf(stderr, "ERROR: short write of %d blocks\n", count);
+    error_count++;
+  }
+  free(buffer);
+}
+
+/* check_file() - check that a file holds count blocks filled with c.
+ */
+void check_file(char *name, char c, int count)
+{
+  char *buffer = malloc(count * BLOCK);
+  int fd;
+  int i;
+
+  if (sfs_getfilesize(name) != count * BLOCK) {
+    fprintf(stderr, "ERROR: %s has %d bytes instead of %d\n", name,
+            sfs_getfilesize(name), count * BLOCK);
+    error_count++;
+  }
+  fd = sfs_fopen(name);
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buffer, count * BLOCK) != count * BLOCK) {
+    fprintf(stderr, "ERROR: short read of %s\n", name);
+    error_count++;
+  }
+  for (i = 0; i < count * BLOCK; i++) {
+    if (buffer[i] != c) {
+      fprintf(stderr, "ERROR: wrong byte in %s at position %d (%d,%d)\n",
+              name, i, buffer[i], c);
+      error_count++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+  free(buffer);
+}
+
+/* The index blocks of a file grow with the appends that follow the
+ * sync, and reach the disk before the crash as the blocks appended one
+ * at a time push them out of the cache.
+ */
+void append_after_sync(void)
+{
+  int fd = sfs_fopen("grown");
+  int i;
+
+  write_filled(fd, 'g', SYNCED_BLOCKS);
+  sfs_sync();
+  for (i = 0; i < LOST_BLOCKS; i++) {
+    write_filled(fd, 'x', 1);
+  }
+}
+
+/* The blocks of a file removed after the sync must not be reused
+ * before the removal is synced, since a crash brings the file back.
+ */
+void remove_after_sync(void)
+{
+  int fd = sfs_fopen("removed");
+
+  write_filled(fd, 'r', REMOVED_BLOCKS);
+  sfs_sync();
+  sfs_remove("removed");
+  fd = sfs_fopen("reused");
+  write_filled(fd, 'x', REMOVED_BLOCKS);
+}
+
+/* Once mounted again, the blocks appended before the crash are free,
+ * so a new file may take them, and growing the old one must not write
+ * over it.
+ */
+void grow_after_crash(void)
+{
+  int fd;
+
+  check_file("grown", 'g', SYNCED_BLOCKS);
+  fd = sfs_fopen("new");
+  write_filled(fd, 'n', NEW_BLOCKS);
+  sfs_fclose(fd);
+  fd = sfs_fopen("grown");
+  write_filled(fd, 'g', NEW_BLOCKS);
+  sfs_fclose(fd);
+  check_file("new", 'n', NEW_BLOCKS);
+  check_file("grown", 'g', SYNCED_BLOCKS + NEW_BLOCKS);
+}
+
+/* Removing the old file frees its blocks, and only those.
+ */
+void remove_grown(void)
+{
+  int fd;
+
+  check_file("new", 'n', NEW_BLOCKS);
+  check_file("grown", 'g', SYNCED_BLOCKS + NEW_BLOCKS);
+  sfs_remove("grown");
+  sfs_sync();
+  fd = sfs_fopen("filler");
+  write_filled(fd, 'f', FILLER_BLOCKS);
+  sfs_fclose(fd);
+  check_file("new", 'n', NEW_BLOCKS);
+  check_file("filler", 'f', FILLER_BLOCKS);
+}
+
+/* The removal was not synced, so the file is back with its data.
+ */
+void check_removed(void)
+{
+  check_file("removed", 'r', REMOVED_BLOCKS);
+  if (sfs_getfilesize("reused") != -1) {
+    fprintf(stderr, "ERROR: a file created after the sync survived\n");
+    error_count++;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  run(append_after_sync, 1);
+  run(grow_after_crash, 0);
+  run(remove_grown, 0);
+
+  run(remove_after_sync, 1);
+  run(check_removed, 0);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
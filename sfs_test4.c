@@ -0,0 +1,138 @@
+/* sfs_test4.c
+ *
+ * Group commit test. Several threads each write their own file and fsync
+ * it after every write. The syncs waiting at the same time share one
+ * commit, so there must be fewer commits than sfs_fsync calls, and every
+ * file must hold what was synced once mounted again. Closing files that
+ * were only read must not sync at all.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define THREADS 8               /* threads syncing at once */
+#define ROUNDS 20               /* writes and syncs by each thread */
+#define CHUNK 1000              /* bytes written before each sync */
+#define SYNC_DELAY 2000         /* microseconds a commit waits for others */
+
+static int error_count = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void error(const char *what, int thread)
+{
+  pthread_mutex_lock(&error_lock);
+  fprintf(stderr, "ERROR: %s (thread %d)\n", what, thread);
+  error_count++;
+  pthread_mutex_unlock(&error_lock);
+}
+
+/* writer() - append ROUNDS chunks to a file of its own, syncing after
+ * each of them.
+ */
+static void *writer(void *arg)
+{
+  int thread = (int)(long)arg;
+  char name[MAXFILENAME];
+  char chunk[CHUNK];
+  int fd;
+  int i;
+
+  sprintf(name, "sync%d", thread);
+  fd = sfs_fopen(name);
+  if (fd < 0) {
+    error("cannot open the file", thread);
+    return NULL;
+  }
+  for (i = 0; i < ROUNDS; i++) {
+    memset(chunk, 'a' + (thread + i) % 26, CHUNK);
+    if (sfs_fwrite(fd, chunk, CHUNK) != CHUNK) {
+      error("short write", thread);
+    }
+    if (sfs_fsync(fd) < 0) {
+      error("sfs_fsync failed", thread);
+    }
+  }
+  return NULL;
+}
+
+/* check_file() - check that the file of a thread holds all its chunks,
+ * and close it.
+ */
+static void check_file(int thread)
+{
+  char name[MAXFILENAME];
+  char chunk[CHUNK];
+  int fd;
+  int i, j;
+
+  sprintf(name, "sync%d", thread);
+  if (sfs_getfilesize(name) != ROUNDS * CHUNK) {
+    error("wrong file size after the remount", thread);
+    return;
+  }
+  fd = sfs_fopen(name);
+  sfs_fseek(fd, 0);
+  for (i = 0; i < ROUNDS; i++) {
+    if (sfs_fread(fd, chunk, CHUNK) != CHUNK) {
+      error("short read", thread);
+      break;
+    }
+    for (j = 0; j < CHUNK; j++) {
+      if (chunk[j] != 'a' + (thread + i) % 26) {
+        error("wrong data after the remount", thread);
+        break;
+      }
+    }
+  }
+  sfs_fclose(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+  pthread_t threads[THREADS];
+  SyncStats stats;
+  long i;
+
+  mksfs(1);
+  sfs_set_sync_delay(SYNC_DELAY);
+  sfs_reset_sync_stats();
+  for (i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, writer, (void *)i);
+  }
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  sfs_get_sync_stats(&stats);
+  printf("%ld syncs, %ld commits, %.1f syncs per commit\n", stats.requests,
+         stats.commits,
+         stats.commits > 0 ? (double)stats.batched / stats.commits : 0.0);
+  if (stats.requests != THREADS * ROUNDS) {
+    fprintf(stderr, "ERROR: %ld sync requests counted instead of %d\n",
+            stats.requests, THREADS * ROUNDS);
+    error_count++;
+  }
+  if (stats.commits >= stats.requests) {
+    fprintf(stderr, "ERROR: concurrent syncs did not share commits\n");
+    error_count++;
+  }
+
+  /* remounting reads every file back from the disk */
+  mksfs(0);
+  sfs_reset_sync_stats();
+  for (i = 0; i < THREADS; i++) {
+    check_file(i);
+  }
+  sfs_get_sync_stats(&stats);
+  if (stats.requests != 0) {
+    fprintf(stderr, "ERROR: closing files that were only read synced\n");
+    error_count++;
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,186 @@
+/* sfs_test5.c
+ *
+ * Directory index test. File names are looked up through an open
+ * addressing hash index, so names that hash to the same slot sit one after
+ * the other in a probe chain. The test creates such names, removes some of
+ * them from the middle of the chain, and checks that the names after them
+ * are still found, that removed names are gone, and that a name created
+ * again is only listed once. Creating and removing files many times
+ * rebuilds the index, and remounting builds it from the disk, after which
+ * every name must still be found.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define COLLIDING 12            /* names hashing to the same slot */
+#define HASH_MASK 0xffff        /* slots they share, for any index of up to
+                                   65536 slots */
+#define CHURN 300               /* files created and removed to fill the
+                                   index with deleted slots */
+
+static int error_count = 0;
+static char names[COLLIDING][MAXFILENAME];
+static int present[COLLIDING];
+
+/* hash_name() - the FNV-1a hash the file system indexes names with.
+ */
+static unsigned int hash_name(const char *name)
+{
+  unsigned int hash = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+  return hash;
+}
+
+/* find_colliding() - fill names with names whose hashes agree in the bits
+ * any index uses to pick a slot.
+ */
+static void find_colliding(void)
+{
+  unsigned int slot = 0;
+  int found = 0;
+  int i;
+
+  for (i = 0; found < COLLIDING; i++) {
+    char name[MAXFILENAME];
+
+    sprintf(name, "c%d", i);
+    if (found == 0) {
+      slot = hash_name(name) & HASH_MASK;
+    }
+    if ((hash_name(name) & HASH_MASK) == slot) {
+      strcpy(names[found++], name);
+    }
+  }
+}
+
+/* create() - create a file holding its own name.
+ */
+static void create(int i)
+{
+  int fd = sfs_fopen(names[i]);
+
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: cannot create %s\n", names[i]);
+    error_count++;
+    return;
+  }
+  sfs_fwrite(fd, names[i], strlen(names[i]));
+  sfs_fclose(fd);
+  present[i] = 1;
+}
+
+/* check_names() - check that the names present are found, and open the
+ * file holding their name, that the others are not, and that listing the
+ * directory shows each present name exactly once.
+ */
+static void check_names(const char *when)
+{
+  char buffer[MAXFILENAME];
+  int listed[COLLIDING];
+  int i;
+
+  for (i = 0; i < COLLIDING; i++) {
+    int size = sfs_getfilesize(names[i]);
+    int fd;
+
+    listed[i] = 0;
+    if (!present[i]) {
+      if (size != -1) {
+        fprintf(stderr, "ERROR: removed %s found %s\n", names[i], when);
+        error_count++;
+      }
+      continue;
+    }
+    if (size != (int)strlen(names[i])) {
+      fprintf(stderr, "ERROR: %s not found %s (size %d)\n", names[i], when,
+              size);
+      error_count++;
+      continue;
+    }
+    fd = sfs_fopen(names[i]);
+    memset(buffer, 0, sizeof(buffer));
+    sfs_fseek(fd, 0);
+    sfs_fread(fd, buffer, size);
+    if (strcmp(buffer, names[i]) != 0) {
+      fprintf(stderr, "ERROR: opening %s gave the file of %s %s\n", names[i],
+              buffer, when);
+      error_count++;
+    }
+    sfs_fclose(fd);
+  }
+
+  while (sfs_getnextfilename(buffer)) {
+    for (i = 0; i < COLLIDING; i++) {
+      if (strcmp(buffer, names[i]) == 0) {
+        listed[i]++;
+      }
+    }
+  }
+  for (i = 0; i < COLLIDING; i++) {
+    if (listed[i] != present[i]) {
+      fprintf(stderr, "ERROR: %s listed %d times %s\n", names[i], listed[i],
+              when);
+      error_count++;
+    }
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char name[MAXFILENAME];
+  int i;
+
+  find_colliding();
+  mksfs(1);
+  for (i = 0; i < COLLIDING; i++) {
+    create(i);
+  }
+  check_names("in one probe chain");
+
+  /* the names after a removed one are still reached past its slot */
+  for (i = 1; i < COLLIDING; i += 3) {
+    if (sfs_remove(names[i]) < 0) {
+      fprintf(stderr, "ERROR: cannot remove %s\n", names[i]);
+      error_count++;
+    }
+    present[i] = 0;
+  }
+  if (sfs_remove(names[1]) != -1) {
+    fprintf(stderr, "ERROR: %s removed twice\n", names[1]);
+    error_count++;
+  }
+  check_names("after removals");
+
+  /* a name created again takes a single slot */
+  create(1);
+  check_names("after creating a name again");
+
+  /* enough removals rebuild the index, which must keep the chain */
+  for (i = 0; i < CHURN; i++) {
+    int fd;
+
+    sprintf(name, "churn%d", i);
+    fd = sfs_fopen(name);
+    sfs_fclose(fd);
+    if (sfs_remove(name) < 0) {
+      fprintf(stderr, "ERROR: cannot remove %s\n", name);
+      error_count++;
+    }
+  }
+  check_names("after rebuilding the index");
+
+  /* the index of a mounted file system is built from the directory */
+  sfs_sync();
+  mksfs(0);
+  check_names("after the remount");
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,203 @@
+/* sfs_test6.c
+ *
+ * Geometry test. A file system formatted with a block size, disk size and
+ * inode count of its own must hold a file larger than the default disk,
+ * and as many files as it has inodes for. Mounting it again in a new
+ * process must find that geometry in the superblock. Geometries that do
+ * not describe a usable file system must be rejected, and leave the one
+ * mounted as it was. So must an image whose superblock records a format
+ * version newer than the file system knows.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 4096              /* block size of the file system */
+#define DISK_BLOCKS 3000        /* blocks of the disk */
+#define INODES 40               /* inodes, the root directory's included */
+#define FILE_BLOCKS 2000        /* blocks of the large file, more bytes than
+                                   the default disk holds */
+#define VERSION_OFFSET 20       /* of the format version in the superblock */
+
+static int error_count = 0;
+
+static SfsGeometry geometry = { BLOCK, DISK_BLOCKS, INODES };
+
+/* geometries that must be rejected, and why */
+static struct {
+  SfsGeometry geometry;
+  const char *why;
+} bad[] = {
+  { { 1000, DISK_BLOCKS, INODES }, "a block size that is not a power of two" },
+  { { 256, DISK_BLOCKS, INODES }, "a block size below 512" },
+  { { 131072, DISK_BLOCKS, INODES }, "a block size above 65536" },
+  { { BLOCK, 0, INODES }, "an empty disk" },
+  { { BLOCK, 4, INODES }, "a disk too small for its tables" },
+  { { BLOCK, DISK_BLOCKS, 1 }, "no inode besides the root directory's" },
+  { { 512, 100, 10000 }, "more inodes than the disk has room for" },
+};
+
+/* run() - run a step in a child process, so that mounting without
+ * formatting reads the superblock from the disk.
+ */
+static void run(void (*step)(void))
+{
+  pid_t pid = fork();
+  int status;
+
+  if (pid == 0) {
+    step();
+    _exit(error_count);
+  }
+  waitpid(pid, &status, 0);
+  error_count += WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/* fill() - fill a buffer of count blocks with a pattern telling the
+ * blocks apart.
+ */
+static void fill(char *buffer, int count)
+{
+  int i;
+
+  for (i = 0; i < count * BLOCK; i++) {
+    buffer[i] = 'a' + (i / BLOCK + i) % 26;
+  }
+}
+
+/* check_large() - check that the large file holds the pattern.
+ */
+static void check_large(const char *when)
+{
+  char *expected = malloc(FILE_BLOCKS * BLOCK);
+  char *buffer = malloc(FILE_BLOCKS * BLOCK);
+  int fd;
+
+  fill(expected, FILE_BLOCKS);
+  if (sfs_getfilesize("large") != FILE_BLOCKS * BLOCK) {
+    fprintf(stderr, "ERROR: large file has %d bytes %s\n",
+            sfs_getfilesize("large"), when);
+    error_count++;
+  }
+  fd = sfs_fopen("large");
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buffer, FILE_BLOCKS * BLOCK) != FILE_BLOCKS * BLOCK ||
+      memcmp(buffer, expected, FILE_BLOCKS * BLOCK) != 0) {
+    fprintf(stderr, "ERROR: wrong data in the large file %s\n", when);
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(expected);
+  free(buffer);
+}
+
+/* Format with the geometry and write a file larger than the default disk.
+ */
+static void format(void)
+{
+  char *buffer = malloc(FILE_BLOCKS * BLOCK);
+  int fd;
+
+  if (mksfs_geometry(1, &geometry) < 0) {
+    fprintf(stderr, "ERROR: cannot format with a valid geometry\n");
+    _exit(1);
+  }
+  fill(buffer, FILE_BLOCKS);
+  fd = sfs_fopen("large");
+  if (sfs_fwrite(fd, buffer, FILE_BLOCKS * BLOCK) != FILE_BLOCKS * BLOCK) {
+    fprintf(stderr, "ERROR: short write of the large file\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(buffer);
+  check_large("after writing it");
+}
+
+/* Mount without a geometry, which must come from the superblock, then
+ * use up the inodes and try the bad geometries.
+ */
+static void remount(void)
+{
+  char name[MAXFILENAME];
+  int fd;
+  int i;
+
+  mksfs(0);
+  check_large("after the remount");
+
+  /* the large file and the root directory take an inode each */
+  for (i = 0; i < INODES - 2; i++) {
+    sprintf(name, "small%d", i);
+    fd = sfs_fopen(name);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR: cannot create file %d of %d\n", i + 1,
+              INODES - 2);
+      error_count++;
+      break;
+    }
+    sfs_fclose(fd);
+  }
+  if (sfs_fopen("extra") >= 0) {
+    fprintf(stderr, "ERROR: created more files than there are inodes\n");
+    error_count++;
+  }
+
+  for (i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+    if (mksfs_geometry(1, &bad[i].geometry) != -1) {
+      fprintf(stderr, "ERROR: formatted with %s\n", bad[i].why);
+      error_count++;
+    }
+  }
+  check_large("after the bad geometries");
+}
+
+/* set_version() - add delta to the format version the superblock of the
+ * image records.
+ */
+static void set_version(int delta)
+{
+  FILE *image = fopen("my_sfs", "r+b");
+  int version;
+
+  fseek(image, VERSION_OFFSET, SEEK_SET);
+  fread(&version, sizeof(version), 1, image);
+  version += delta;
+  fseek(image, VERSION_OFFSET, SEEK_SET);
+  fwrite(&version, sizeof(version), 1, image);
+  fclose(image);
+}
+
+/* An image of a newer format version must not be mounted, and the same
+ * image of the current version still must be.
+ */
+static void newer_version(void)
+{
+  set_version(1);
+  if (mksfs_geometry(0, NULL) != -1) {
+    fprintf(stderr, "ERROR: mounted an image of a newer version\n");
+    error_count++;
+    return;
+  }
+  set_version(-1);
+  if (mksfs_geometry(0, NULL) < 0) {
+    fprintf(stderr, "ERROR: cannot mount the image again\n");
+    error_count++;
+    return;
+  }
+  check_large("after refusing the newer version");
+}
+
+int
+main(int argc, char **argv)
+{
+  run(format);
+  run(remount);
+  run(newer_version);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,150 @@
+/* sfs_test7.c
+ *
+ * Triple indirect block test. With 512 byte blocks an index block holds
+ * 128 block numbers, so a file of more than 10 + 128 + 128 * 128 blocks
+ * needs the triple indirect block. The test writes such a file, reads back
+ * the blocks on either side of each index level, and the whole file once
+ * mounted again. Removing it must free every block, index blocks
+ * included, which the number of blocks a file filling the disk gets
+ * before and after tells.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 512               /* block size of the file system */
+#define PTRS (BLOCK / 4)        /* block numbers in an index block */
+#define DIRECT 10               /* direct blocks of an inode */
+#define TRIPLE_START (DIRECT + PTRS + PTRS * PTRS)
+                                /* first block mapped by the triple
+                                   indirect block */
+#define FILE_BLOCKS (TRIPLE_START + 2 * PTRS + 5)
+                                /* blocks of the large file */
+#define DISK_BLOCKS 17500       /* blocks of the disk */
+
+static int error_count = 0;
+
+static SfsGeometry geometry = { BLOCK, DISK_BLOCKS, 10 };
+
+/* fill() - fill a block with a pattern telling it apart from the others.
+ */
+static void fill(char *block, int n)
+{
+  int i;
+
+  for (i = 0; i < BLOCK; i++) {
+    block[i] = 'a' + (n * 7 + i) % 26;
+  }
+  memcpy(block, &n, sizeof(n));
+}
+
+/* fill_disk() - write blocks to a new file until the disk is full, and
+ * return how many it took.
+ */
+static int fill_disk(char *name)
+{
+  char block[BLOCK];
+  int fd = sfs_fopen(name);
+  int count = 0;
+
+  memset(block, 'f', BLOCK);
+  while (sfs_fwrite(fd, block, BLOCK) == BLOCK) {
+    count++;
+  }
+  sfs_fclose(fd);
+  return count;
+}
+
+/* check_block() - check that block n of the file open as fd holds its
+ * pattern, -1 if it does not.
+ */
+static int check_block(int fd, int n, const char *when)
+{
+  char expected[BLOCK];
+  char block[BLOCK];
+
+  fill(expected, n);
+  sfs_fseek(fd, n * BLOCK);
+  if (sfs_fread(fd, block, BLOCK) != BLOCK ||
+      memcmp(block, expected, BLOCK) != 0) {
+    fprintf(stderr, "ERROR: wrong data in block %d %s\n", n, when);
+    error_count++;
+    return -1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  /* blocks on either side of where each index level starts, and the end */
+  int edges[] = { 0, DIRECT - 1, DIRECT, DIRECT + PTRS - 1, DIRECT + PTRS,
+                  TRIPLE_START - 1, TRIPLE_START, TRIPLE_START + PTRS - 1,
+                  TRIPLE_START + PTRS, FILE_BLOCKS - 1 };
+  char block[BLOCK];
+  int full, refilled;
+  int fd;
+  int i;
+
+  if (mksfs_geometry(1, &geometry) < 0) {
+    fprintf(stderr, "ERROR: cannot format with 512 byte blocks\n");
+    return 1;
+  }
+  full = fill_disk("filler");
+  sfs_remove("filler");
+  sfs_sync();
+  if (full < FILE_BLOCKS) {
+    fprintf(stderr, "ERROR: only %d blocks fit on the disk\n", full);
+    error_count++;
+  }
+
+  fd = sfs_fopen("large");
+  for (i = 0; i < FILE_BLOCKS; i++) {
+    fill(block, i);
+    if (sfs_fwrite(fd, block, BLOCK) != BLOCK) {
+      fprintf(stderr, "ERROR: cannot write block %d\n", i);
+      error_count++;
+      break;
+    }
+  }
+  if (sfs_getfilesize("large") != FILE_BLOCKS * BLOCK) {
+    fprintf(stderr, "ERROR: large file has %d bytes instead of %d\n",
+            sfs_getfilesize("large"), FILE_BLOCKS * BLOCK);
+    error_count++;
+  }
+  for (i = 0; i < (int)(sizeof(edges) / sizeof(edges[0])); i++) {
+    check_block(fd, edges[i], "after writing it");
+  }
+  /* writing over a block mapped by the triple indirect block */
+  fill(block, TRIPLE_START + 1);
+  sfs_fseek(fd, TRIPLE_START * BLOCK);
+  sfs_fwrite(fd, block, BLOCK);
+  fill(block, TRIPLE_START);
+  sfs_fseek(fd, TRIPLE_START * BLOCK);
+  sfs_fwrite(fd, block, BLOCK);
+  sfs_fclose(fd);
+
+  /* remounting reads the whole block map back from the disk */
+  mksfs(0);
+  fd = sfs_fopen("large");
+  for (i = 0; i < FILE_BLOCKS; i++) {
+    if (check_block(fd, i, "after the remount") < 0) {
+      break;
+    }
+  }
+  sfs_fclose(fd);
+
+  sfs_remove("large");
+  sfs_sync();
+  refilled = fill_disk("filler");
+  if (refilled != full) {
+    fprintf(stderr, "ERROR: %d blocks fit after removing the file, %d "
+            "before\n", refilled, full);
+    error_count++;
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,146 @@
+/* sfs_test8.c
+ *
+ * Positional read and write test. sfs_pread and sfs_pwrite at random
+ * offsets, unaligned and straddling blocks, are checked against a copy of
+ * the file kept in memory, appends included. They must never move the
+ * offset of the file descriptor, which sfs_fread and sfs_fwrite use
+ * afterwards. Offsets past the end of the file are refused by sfs_pwrite,
+ * and read nothing with sfs_pread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 1024              /* block size of a default file system */
+#define INITIAL (20 * BLOCK + 300)
+                                /* bytes written before the test */
+#define MAX_SIZE (60 * BLOCK)   /* bytes the file may grow to */
+#define MAX_LENGTH (3 * BLOCK)  /* bytes of a single call */
+#define ROUNDS 2000             /* calls to sfs_pread and sfs_pwrite */
+#define MARK 4321               /* offset of the file descriptor */
+
+static int error_count = 0;
+static char model[MAX_SIZE];    /* what the file must hold */
+static int size = 0;            /* bytes of it in the file */
+
+/* check_range() - check that length bytes read from offset match the
+ * model.
+ */
+static void check_range(const char *buffer, int offset, int length,
+                        const char *what)
+{
+  if (memcmp(buffer, model + offset, length) != 0) {
+    fprintf(stderr, "ERROR: %s of %d bytes at %d read wrong data\n", what,
+            length, offset);
+    error_count++;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char buffer[MAX_SIZE];
+  int fd;
+  int i;
+
+  srand(8);
+  mksfs(1);
+  fd = sfs_fopen("positional");
+  for (i = 0; i < INITIAL; i++) {
+    model[i] = 'a' + i % 26;
+  }
+  sfs_fwrite(fd, model, INITIAL);
+  size = INITIAL;
+  sfs_fseek(fd, MARK);
+
+  for (i = 0; i < ROUNDS; i++) {
+    int offset = rand() % (size + 1);
+    int length = 1 + rand() % MAX_LENGTH;
+    int j;
+
+    if (rand() % 2) {
+      if (offset + length > MAX_SIZE) {
+        length = MAX_SIZE - offset;
+      }
+      for (j = 0; j < length; j++) {
+        buffer[j] = 'A' + rand() % 26;
+      }
+      if (sfs_pwrite(fd, buffer, length, offset) != length) {
+        fprintf(stderr, "ERROR: sfs_pwrite of %d bytes at %d failed\n",
+                length, offset);
+        error_count++;
+        continue;
+      }
+      memcpy(model + offset, buffer, length);
+      if (offset + length > size) {
+        size = offset + length;
+      }
+    } else {
+      int expected = offset + length > size ? size - offset : length;
+
+      if (sfs_pread(fd, buffer, length, offset) != expected) {
+        fprintf(stderr, "ERROR: sfs_pread of %d bytes at %d did not read "
+                "%d\n", length, offset, expected);
+        error_count++;
+        continue;
+      }
+      check_range(buffer, offset, expected, "sfs_pread");
+    }
+  }
+  if (sfs_getfilesize("positional") != size) {
+    fprintf(stderr, "ERROR: file has %d bytes instead of %d\n",
+            sfs_getfilesize("positional"), size);
+    error_count++;
+  }
+
+  /* past the end of the file */
+  if (sfs_pwrite(fd, "x", 1, size + 1) != -1) {
+    fprintf(stderr, "ERROR: sfs_pwrite past the end of the file\n");
+    error_count++;
+  }
+  if (sfs_pread(fd, buffer, 10, size + 1) != 0 ||
+      sfs_pread(fd, buffer, 10, size) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread past the end of the file read data\n");
+    error_count++;
+  }
+  if (sfs_pread(fd, buffer, 10, -1) != -1) {
+    fprintf(stderr, "ERROR: sfs_pread at a negative offset\n");
+    error_count++;
+  }
+
+  /* the file descriptor is still where it was put */
+  if (sfs_fread(fd, buffer, 100) != 100) {
+    fprintf(stderr, "ERROR: short sfs_fread at the mark\n");
+    error_count++;
+  }
+  check_range(buffer, MARK, 100, "sfs_fread after the positional calls");
+  sfs_fwrite(fd, "marked", 6);
+  memcpy(model + MARK + 100, "marked", 6);
+  if (sfs_pread(fd, buffer, 6, MARK + 100) != 6) {
+    fprintf(stderr, "ERROR: short sfs_pread of what sfs_fwrite wrote\n");
+    error_count++;
+  }
+  check_range(buffer, MARK + 100, 6, "sfs_pread after sfs_fwrite");
+  sfs_fclose(fd);
+
+  if (sfs_pread(fd, buffer, 10, 0) != -1 ||
+      sfs_pwrite(fd, "x", 1, 0) != -1) {
+    fprintf(stderr, "ERROR: positional call on a closed file\n");
+    error_count++;
+  }
+
+  /* remounting reads the whole file back from the disk */
+  mksfs(0);
+  fd = sfs_fopen("positional");
+  if (sfs_pread(fd, buffer, MAX_SIZE, 0) != size) {
+    fprintf(stderr, "ERROR: short sfs_pread after the remount\n");
+    error_count++;
+  }
+  check_range(buffer, 0, size, "sfs_pread after the remount");
+  sfs_fclose(fd);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
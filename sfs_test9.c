@@ -0,0 +1,169 @@
+/* sfs_test9.c
+ *
+ * Free block bitmap test. The free block map keeps one bit per block in 64
+ * bit words, and the disk here ends part way through its last word. Two
+ * files appended in turn until the disk is full take blocks from every
+ * word, that last one included, and must each read back what was written to
+ * them, which no block handed out twice or past the end of the disk would.
+ * The disk is sized so that the index blocks they need last are allocated
+ * when only the bits past its end could still be free. The blocks a removed
+ * file frees, scattered between those of the other, must all be found
+ * again, and once everything is removed a file must fill the disk as it did
+ * when it was fresh.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 1024              /* block size of the file system */
+#define DISK_BLOCKS 2092        /* blocks of the disk, 44 past a word, so
+                                   that the files need index blocks as the
+                                   disk runs out */
+#define FILES 3                 /* files of the test */
+
+static int error_count = 0;
+
+static SfsGeometry geometry = { BLOCK, DISK_BLOCKS, 10 };
+static char *names[FILES] = { "first", "second", "third" };
+static int blocks[FILES];       /* blocks written to each file */
+
+/* fill() - fill block n of a file with a pattern telling it apart from
+ * every other block of every file.
+ */
+static void fill(char *block, int file, int n)
+{
+  int i;
+
+  for (i = 0; i < BLOCK; i++) {
+    block[i] = 'a' + (file * 11 + n * 7 + i) % 26;
+  }
+  memcpy(block, &n, sizeof(n));
+  block[sizeof(n)] = file;
+}
+
+/* append() - append the next block to a file, 0 when the disk is full.
+ */
+static int append(int fd, int file)
+{
+  char block[BLOCK];
+
+  fill(block, file, blocks[file]);
+  if (sfs_fwrite(fd, block, BLOCK) != BLOCK) {
+    return 0;
+  }
+  blocks[file]++;
+  return 1;
+}
+
+/* fill_disk() - append to a new file until the disk is full.
+ */
+static void fill_disk(int file)
+{
+  int fd = sfs_fopen(names[file]);
+
+  blocks[file] = 0;
+  while (append(fd, file)) {
+  }
+  sfs_fclose(fd);
+}
+
+/* check_file() - check that every block of a file holds its pattern.
+ */
+static void check_file(int file, const char *when)
+{
+  char expected[BLOCK];
+  char block[BLOCK];
+  int fd = sfs_fopen(names[file]);
+  int i;
+
+  if (sfs_getfilesize(names[file]) != blocks[file] * BLOCK) {
+    fprintf(stderr, "ERROR: %s has %d bytes instead of %d %s\n", names[file],
+            sfs_getfilesize(names[file]), blocks[file] * BLOCK, when);
+    error_count++;
+  }
+  sfs_fseek(fd, 0);
+  for (i = 0; i < blocks[file]; i++) {
+    fill(expected, file, i);
+    if (sfs_fread(fd, block, BLOCK) != BLOCK ||
+        memcmp(block, expected, BLOCK) != 0) {
+      fprintf(stderr, "ERROR: wrong data in block %d of %s %s\n", i,
+              names[file], when);
+      error_count++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+  int fresh;
+  int fd[2];
+  int more[2] = { 1, 1 };
+  int i;
+
+  if (mksfs_geometry(1, &geometry) < 0) {
+    fprintf(stderr, "ERROR: cannot format the disk\n");
+    return 1;
+  }
+  fill_disk(0);
+  fresh = blocks[0];
+  check_file(0, "on the fresh disk");
+  sfs_remove(names[0]);
+  sfs_sync();
+
+  /* two files growing side by side take turns through the words */
+  fd[0] = sfs_fopen(names[0]);
+  fd[1] = sfs_fopen(names[1]);
+  blocks[0] = blocks[1] = 0;
+  while (more[0] || more[1]) {
+    for (i = 0; i < 2; i++) {
+      if (more[i]) {
+        more[i] = append(fd[i], i);
+      }
+    }
+  }
+  sfs_fclose(fd[0]);
+  sfs_fclose(fd[1]);
+  if (blocks[0] + blocks[1] > fresh) {
+    fprintf(stderr, "ERROR: %d blocks written to two files, %d fit in one\n",
+            blocks[0] + blocks[1], fresh);
+    error_count++;
+  }
+  check_file(0, "filled side by side");
+  check_file(1, "filled side by side");
+
+  /* the blocks of the first file, between those of the second, are free
+     again once its removal is synced */
+  sfs_remove(names[0]);
+  sfs_sync();
+  fill_disk(2);
+  if (blocks[2] != blocks[0]) {
+    fprintf(stderr, "ERROR: %d blocks fit where %s had %d\n", blocks[2],
+            names[0], blocks[0]);
+    error_count++;
+  }
+  check_file(1, "after filling the freed blocks");
+  check_file(2, "after filling the freed blocks");
+
+  /* the bitmap read back from the disk has the same blocks in use */
+  mksfs(0);
+  check_file(1, "after the remount");
+  check_file(2, "after the remount");
+  sfs_remove(names[1]);
+  sfs_remove(names[2]);
+  sfs_sync();
+  fill_disk(0);
+  if (blocks[0] != fresh) {
+    fprintf(stderr, "ERROR: %d blocks fit on the emptied disk, %d on the "
+            "fresh one\n", blocks[0], fresh);
+    error_count++;
+  }
+  check_file(0, "on the emptied disk");
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,51 @@
+#ifndef SFS_TRACE_H
+#define SFS_TRACE_H
+
+// Binary trace of SFS API calls, written by sfs_trace_start (or by setting
+// SFS_TRACE to a file name before mksfs) and read by sfs_replay.c. A trace
+// is a TraceHeader followed by one TraceRecord per call, in the order the
+// calls returned. Calls taking a file name have it right after their record.
+// Everything is in the byte order of the machine that wrote the trace.
+
+#include <stdint.h>
+
+#define SFS_TRACE_MAGIC 0x54534653  // "SFST"
+#define SFS_TRACE_VERSION 1
+
+// traced calls
+#define TRACE_FOPEN 0
+#define TRACE_FCLOSE 1
+#define TRACE_FREAD 2
+#define TRACE_FWRITE 3
+#define TRACE_PREAD 4
+#define TRACE_PWRITE 5
+#define TRACE_FSEEK 6
+#define TRACE_REMOVE 7
+#define TRACE_GETNEXTFILENAME 8
+#define TRACE_GETFILESIZE 9
+#define TRACE_SYNC 10
+#define TRACE_FSYNC 11
+#define TRACE_FTRUNCATE 12
+#define TRACE_OPS 13
+
+// the geometry of the file system the calls ran on
+typedef struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+  int32_t block_size;
+  int32_t num_blocks;
+  int32_t num_inodes;
+} TraceHeader;
+
+typedef struct __attribute__((packed)) trace_record {
+  int64_t time_ns;      // start of the call, since tracing started
+  uint32_t latency_ns;  // time the call took, at most UINT32_MAX
+  int32_t fd;           // -1 for calls without one
+  int32_t offset;       // pread, pwrite and fseek offset, -1 otherwise
+  int32_t length;       // bytes asked for by reads and writes
+  int32_t result;       // what the call returned
+  uint8_t op;           // TRACE_*
+  uint8_t name_len;     // bytes of the file name that follows
+} TraceRecord;
+
+#endif